@@ -8,22 +8,60 @@
 #include <math.h>
 #include <stdexcept>
 
+template <typename T>
+int rst::rasterizer::load_buffer(const std::vector<T>& values)
+{
+    auto storage = std::make_shared<std::vector<T>>(values); // һɹդ
+    buffers.push_back({storage, storage->data(), storage->size(), &typeid(T), sizeof(T)});
+    return (int)buffers.size() - 1; // IDе±
+}
+
+template <typename T>
+int rst::rasterizer::register_buffer(buffer_span<const T> values)
+{
+    buffers.push_back({nullptr, const_cast<T*>(values.data), values.count, &typeid(T), sizeof(T)}); // ֻ¼ڴָ
+    return (int)buffers.size() - 1;
+}
+
+template <typename T>
+rst::buffer_span<T> rst::rasterizer::map_buffer(int id)
+{
+    const buffer_object& b = checked_buffer<T>(id);
+    if (!b.storage)
+        throw std::runtime_error("Only buffers loaded into the rasterizer can be mapped");
+    return {static_cast<T*>(b.data), b.count};
+}
+
 // ضλ
 rst::pos_buf_id rst::rasterizer::load_positions(const std::vector<Eigen::Vector3f> &positions)
 {
-    auto id = get_next_id();  // ΪλݷΨһID
-    pos_buf.emplace(id, positions); // ݴ洢 pos_buf ӳ
-
-    return {id}; // λûIDں
+    return {load_buffer(positions)}; // λûIDں
 }
 
 // 
 rst::ind_buf_id rst::rasterizer::load_indices(const std::vector<Eigen::Vector3i> &indices)
 {
-    auto id = get_next_id(); // εĶ
-    ind_buf.emplace(id, indices); // ÿ Vector3i һε
+    return {load_buffer(indices)}; // ÿ Vector3i һε
+}
 
-    return {id};
+rst::pos_buf_id rst::rasterizer::register_positions(buffer_span<const Eigen::Vector3f> positions)
+{
+    return {register_buffer(positions)};
+}
+
+rst::ind_buf_id rst::rasterizer::register_indices(buffer_span<const Eigen::Vector3i> indices)
+{
+    return {register_buffer(indices)};
+}
+
+rst::buffer_span<Eigen::Vector3f> rst::rasterizer::map_positions(pos_buf_id pos_buffer)
+{
+    return map_buffer<Eigen::Vector3f>(pos_buffer.pos_id);
+}
+
+rst::buffer_span<Eigen::Vector3i> rst::rasterizer::map_indices(ind_buf_id ind_buffer)
+{
+    return map_buffer<Eigen::Vector3i>(ind_buffer.ind_id);
 }
 
 // Bresenham's line drawing algorithm
@@ -133,60 +171,93 @@ auto to_vec4(const Eigen::Vector3f& v3, float w = 1.0f)
     return Vector4f(v3.x(), v3.y(), v3.z(), w); // תߣ3DתΪ4D꣬ĬwΪ1.0
 }
 
+// ׶üƽ棺Ϊƽ⣨-w <= x, y, z <= w
+static const Eigen::Vector4f clip_planes[] = {
+        {1, 0, 0, 1}, {-1, 0, 0, 1}, {0, 1, 0, 1}, {0, -1, 0, 1}, {0, 0, 1, 1}, {0, 0, -1, 1}
+};
+
+// Twice the signed screen space area of the clip space triangle, scaled by
+// w0 * w1 * w2: positive for counter-clockwise triangles on screen, whatever
+// the signs of their w, so it decides facing before any clipping
+static float facing(const Eigen::Vector4f* c)
+{
+    Eigen::Matrix3f m;
+    for (int k = 0; k < 3; ++k)
+        m.row(k) << c[k].x(), c[k].y(), c[k].w();
+    return m.determinant();
+}
+
 void rst::rasterizer::draw(rst::pos_buf_id pos_buffer, rst::ind_buf_id ind_buffer, rst::Primitive type)
 {
     if (type != rst::Primitive::Triangle)
     {
         throw std::runtime_error("Drawing primitives other than triangle is not implemented yet!");
     }
-    auto& buf = pos_buf[pos_buffer.pos_id];
-    auto& ind = ind_buf[ind_buffer.ind_id];
-
-    float f1 = (100 - 0.1) / 2.0;
-    float f2 = (100 + 0.1) / 2.0;
+    auto buf = buffer<Eigen::Vector3f>(pos_buffer.pos_id);
+    auto ind = buffer<Eigen::Vector3i>(ind_buffer.ind_id);
+    check_indices(ind, buf.count);
 
     Eigen::Matrix4f mvp = projection * view * model; // MVP任
     for (auto& i : ind)
     {
-        Triangle t;
-
         Eigen::Vector4f v[] = {
                 mvp * to_vec4(buf[i[0]], 1.0f), // MVP任:任һ
                 mvp * to_vec4(buf[i[1]], 1.0f), // MVP任:任ڶ
                 mvp * to_vec4(buf[i[2]], 1.0f) // MVP任:任
         };
 
-        for (auto& vec : v) {
-            vec /= vec.w(); // ͸ӳ׼
-        }
+        // ׶޳㶼ͬһüƽ֮
+        bool outside = false;
+        for (auto& plane : clip_planes)
+            outside = outside || (plane.dot(v[0]) < 0 && plane.dot(v[1]) < 0 && plane.dot(v[2]) < 0);
+        if (outside)
+            continue;
+        // ޳ѡ
+        if (culling == Culling::Back && facing(v) <= 0)
+            continue;
 
-        for (auto & vert : v)
-        {
-            vert.x() = 0.5*width*(vert.x()+1.0); // ӿڱ任[-1,1]  [0,width]
-            vert.y() = 0.5*height*(vert.y()+1.0); // ӿڱ任[-1,1]  [0,height]
-            vert.z() = vert.z() * f1 + f2; // ӿڱ任ֵӳ
-        }
+        rasterize_wireframe(v);
+    }
+}
 
-        for (int i = 0; i < 3; ++i)
-        {
-            t.setVertex(i, v[i].head<3>());
-            t.setVertex(i, v[i].head<3>());
-            t.setVertex(i, v[i].head<3>());
-        }
+// Parametric (Liang-Barsky) clipping in clip space, before the perspective
+// division, so that segments crossing the near plane never reach it and
+// Bresenham only walks on-screen pixels
+void rst::rasterizer::draw_clipped_line(Eigen::Vector4f a, Eigen::Vector4f b)
+{
+    float t0 = 0, t1 = 1;
+    for (auto& plane : clip_planes)
+    {
+        float da = plane.dot(a), db = plane.dot(b);
+        if (da < 0 && db < 0)
+            return;
+        if (da < 0)
+            t0 = std::max(t0, da / (da - db));
+        else if (db < 0)
+            t1 = std::min(t1, da / (da - db));
+    }
+    if (t0 > t1)
+        return;
 
-        t.setColor(0, 255.0,  0.0,  0.0); // öԣɫ
-        t.setColor(1, 0.0  ,255.0,  0.0); // öԣɫ
-        t.setColor(2, 0.0  ,  0.0,255.0); // öԣɫ
+    float f1 = (100 - 0.1) / 2.0;
+    float f2 = (100 + 0.1) / 2.0;
 
-        rasterize_wireframe(t);
+    Eigen::Vector4f ends[] = {a + t0 * (b - a), a + t1 * (b - a)};
+    for (auto& vec : ends)
+    {
+        vec /= vec.w(); // ͸ӳ׼
+        vec.x() = 0.5*width*(vec.x()+1.0); // ӿڱ任[-1,1]  [0,width]
+        vec.y() = 0.5*height*(vec.y()+1.0); // ӿڱ任[-1,1]  [0,height]
+        vec.z() = vec.z() * f1 + f2; // ӿڱ任ֵӳ
     }
+    draw_line(ends[0].head<3>(), ends[1].head<3>());
 }
 
-void rst::rasterizer::rasterize_wireframe(const Triangle& t)
+void rst::rasterizer::rasterize_wireframe(const Eigen::Vector4f* v)
 {
-    draw_line(t.c(), t.a()); // Ʊ CA
-    draw_line(t.c(), t.b()); // Ʊ CB
-    draw_line(t.b(), t.a()); // Ʊ BA
+    draw_clipped_line(v[2], v[0]); // Ʊ CA
+    draw_clipped_line(v[2], v[1]); // Ʊ CB
+    draw_clipped_line(v[1], v[0]); // Ʊ BA
 }
 
 void rst::rasterizer::set_model(const Eigen::Matrix4f& m) // 任
@@ -65,6 +65,8 @@ int main(int argc, const char** argv)
     }
 
     rst::rasterizer r(700, 700);
+    // 4x MSAA
+    r.set_msaa(true);
 
     Eigen::Vector3f eye_pos = {0,0,5};
 
@@ -95,9 +97,10 @@ int main(int argc, const char** argv)
                     {185.0, 217.0, 238.0}
             };
 
-    auto pos_id = r.load_positions(pos);
-    auto ind_id = r.load_indices(ind);
-    auto col_id = r.load_colors(cols);
+    // жЧֱעᣬ
+    auto pos_id = r.register_positions({pos.data(), pos.size()});
+    auto ind_id = r.register_indices({ind.data(), ind.size()});
+    auto col_id = r.register_colors({cols.data(), cols.size()});
 
     int key = 0;
     int frame_count = 0;
@@ -8,30 +8,84 @@
 #include "rasterizer.hpp"
 #include <opencv2/opencv.hpp>
 #include <math.h>
+#include <array>
+#include <cstdint>
+#include <stdexcept>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <atomic>
+#include "Simd.hpp"
 
 
-rst::pos_buf_id rst::rasterizer::load_positions(const std::vector<Eigen::Vector3f> &positions)
+template <typename T>
+int rst::rasterizer::load_buffer(const std::vector<T>& values)
 {
-    auto id = get_next_id();
-    pos_buf.emplace(id, positions);
+    auto storage = std::make_shared<std::vector<T>>(values);
+    buffers.push_back({storage, storage->data(), storage->size(), &typeid(T), sizeof(T)});
+    return (int)buffers.size() - 1;
+}
 
-    return {id};
+template <typename T>
+int rst::rasterizer::register_buffer(buffer_span<const T> values)
+{
+    buffers.push_back({nullptr, const_cast<T*>(values.data), values.count, &typeid(T), sizeof(T)});
+    return (int)buffers.size() - 1;
 }
 
-rst::ind_buf_id rst::rasterizer::load_indices(const std::vector<Eigen::Vector3i> &indices)
+template <typename T>
+rst::buffer_span<T> rst::rasterizer::map_buffer(int id)
+{
+    const buffer_object& b = checked_buffer<T>(id);
+    if (!b.storage)
+        throw std::runtime_error("Only buffers loaded into the rasterizer can be mapped");
+    return {static_cast<T*>(b.data), b.count};
+}
+
+rst::pos_buf_id rst::rasterizer::load_positions(const std::vector<Eigen::Vector3f> &positions)
 {
-    auto id = get_next_id();
-    ind_buf.emplace(id, indices);
+    return {load_buffer(positions)};
+}
 
-    return {id};
+rst::ind_buf_id rst::rasterizer::load_indices(const std::vector<Eigen::Vector3i> &indices)
+{
+    return {load_buffer(indices)};
 }
 
 rst::col_buf_id rst::rasterizer::load_colors(const std::vector<Eigen::Vector3f> &cols)
 {
-    auto id = get_next_id();
-    col_buf.emplace(id, cols);
+    return {load_buffer(cols)};
+}
+
+rst::pos_buf_id rst::rasterizer::register_positions(buffer_span<const Eigen::Vector3f> positions)
+{
+    return {register_buffer(positions)};
+}
 
-    return {id};
+rst::ind_buf_id rst::rasterizer::register_indices(buffer_span<const Eigen::Vector3i> indices)
+{
+    return {register_buffer(indices)};
+}
+
+rst::col_buf_id rst::rasterizer::register_colors(buffer_span<const Eigen::Vector3f> colors)
+{
+    return {register_buffer(colors)};
+}
+
+rst::buffer_span<Eigen::Vector3f> rst::rasterizer::map_positions(pos_buf_id pos_buffer)
+{
+    return map_buffer<Eigen::Vector3f>(pos_buffer.pos_id);
+}
+
+rst::buffer_span<Eigen::Vector3i> rst::rasterizer::map_indices(ind_buf_id ind_buffer)
+{
+    return map_buffer<Eigen::Vector3i>(ind_buffer.ind_id);
+}
+
+rst::buffer_span<Eigen::Vector3f> rst::rasterizer::map_colors(col_buf_id col_buffer)
+{
+    return map_buffer<Eigen::Vector3f>(col_buffer.col_id);
 }
 
 auto to_vec4(const Eigen::Vector3f& v3, float w = 1.0f)
@@ -40,139 +94,470 @@ auto to_vec4(const Eigen::Vector3f& v3, float w = 1.0f)
 }
 
 
-static bool insideTriangle(int x, int y, const Vector3f* _v)
-{   
-    // TODO : Implement this function to check if the point (x, y) is inside the triangle represented by _v[0], _v[1], _v[2]
-    // ԵǷڡ
-    
-    // ʹòжϵǷ
-    // PABCڣôPӦABBCCAߵͬһ
-    
-    Vector3f v0 = _v[0];
-    Vector3f v1 = _v[1]; 
-    Vector3f v2 = _v[2];
-    Vector3f p(x, y, 0);  // Ե
-    
-    // ߵ
-    Vector3f edge0 = v1 - v0;  // AB
-    Vector3f edge1 = v2 - v1;  // BC  
-    Vector3f edge2 = v0 - v2;  // CA
-    
-    // Ӹ㵽Ե
-    Vector3f v0p = p - v0;
-    Vector3f v1p = p - v1;
-    Vector3f v2p = p - v2;
-    
-    // z2DֻҪz
-    float cross0 = edge0.x() * v0p.y() - edge0.y() * v0p.x();
-    float cross1 = edge1.x() * v1p.y() - edge1.y() * v1p.x();
-    float cross2 = edge2.x() * v2p.y() - edge2.y() * v2p.x();
-    
-    // ͬţ>=0<=0
-    return (cross0 >= 0 && cross1 >= 0 && cross2 >= 0) || 
-           (cross0 <= 0 && cross1 <= 0 && cross2 <= 0);
-}
-
-static std::tuple<float, float, float> computeBarycentric2D(float x, float y, const Vector3f* v)
-{
-    float c1 = (x*(v[1].y() - v[2].y()) + (v[2].x() - v[1].x())*y + v[1].x()*v[2].y() - v[2].x()*v[1].y()) / (v[0].x()*(v[1].y() - v[2].y()) + (v[2].x() - v[1].x())*v[0].y() + v[1].x()*v[2].y() - v[2].x()*v[1].y());
-    float c2 = (x*(v[2].y() - v[0].y()) + (v[0].x() - v[2].x())*y + v[2].x()*v[0].y() - v[0].x()*v[2].y()) / (v[1].x()*(v[2].y() - v[0].y()) + (v[0].x() - v[2].x())*v[1].y() + v[2].x()*v[0].y() - v[0].x()*v[2].y());
-    float c3 = (x*(v[0].y() - v[1].y()) + (v[1].x() - v[0].x())*y + v[0].x()*v[1].y() - v[1].x()*v[0].y()) / (v[2].x()*(v[0].y() - v[1].y()) + (v[1].x() - v[0].x())*v[2].y() + v[0].x()*v[1].y() - v[1].x()*v[0].y());
-    return {c1,c2,c3};
+// Edge function E(x, y) = a * x + b * y + c evaluated at the center of pixel
+// (x, y), in fixed point with 4 bits of subpixel precision. E >= 0 means the
+// pixel is covered; c already holds the top-left fill rule bias, so a pixel on
+// an edge shared by two triangles is drawn exactly once.
+struct edge_eq
+{
+    int32_t a, b;
+    int64_t c;
+
+    int64_t at(int x, int y) const { return (int64_t)a * x + (int64_t)b * y + c; }
+};
+
+// Screen space extent, in pixels from the origin, that keeps the edge values
+// inside a partially covered block within 32 bits
+constexpr float GUARD_BAND = 8192.0f;
+
+// Clip planes, as the coefficients of a clip space position whose dot product
+// with the position is negative outside. The first six bound the view volume
+// -w <= x, y, z <= w; the guard band planes keep the screen position within
+// GUARD_BAND / 2 of the screen center (for screens smaller than GUARD_BAND).
+enum clip_plane
+{
+    CLIP_LEFT, CLIP_RIGHT, CLIP_BOTTOM, CLIP_TOP, CLIP_NEAR, CLIP_FAR,
+    CLIP_GUARD_LEFT, CLIP_GUARD_RIGHT, CLIP_GUARD_BOTTOM, CLIP_GUARD_TOP,
+    NUM_CLIP_PLANES
+};
+// outcode bits of a vertex outside the view volume
+constexpr int CLIP_FRUSTUM = (1 << CLIP_GUARD_LEFT) - 1;
+// outcode bits of the planes triangles are actually clipped against; the
+// guard band makes clipping against the sides of the view volume unnecessary
+constexpr int CLIP_NEEDED = (1 << CLIP_NEAR) | (1 << CLIP_FAR) | (((1 << NUM_CLIP_PLANES) - 1) & ~CLIP_FRUSTUM);
+
+static std::array<Eigen::Vector4f, NUM_CLIP_PLANES> clip_planes(int width, int height)
+{
+    float gx = GUARD_BAND / width, gy = GUARD_BAND / height;
+    return {Eigen::Vector4f(1, 0, 0, 1), Eigen::Vector4f(-1, 0, 0, 1),
+            Eigen::Vector4f(0, 1, 0, 1), Eigen::Vector4f(0, -1, 0, 1),
+            Eigen::Vector4f(0, 0, 1, 1), Eigen::Vector4f(0, 0, -1, 1),
+            Eigen::Vector4f(1, 0, 0, gx), Eigen::Vector4f(-1, 0, 0, gx),
+            Eigen::Vector4f(0, 1, 0, gy), Eigen::Vector4f(0, -1, 0, gy)};
+}
+
+// Twice the signed screen space area of the clip space triangle, scaled by
+// w0 * w1 * w2: positive for counter-clockwise triangles on screen, whatever
+// the signs of their w, so it decides facing before any clipping
+static float facing(const Eigen::Vector4f* c)
+{
+    Eigen::Matrix3f m;
+    for (int k = 0; k < 3; ++k)
+        m.row(k) << c[k].x(), c[k].y(), c[k].w();
+    return m.determinant();
+}
+
+// Sutherland-Hodgman: clips the convex polygon in[0..n) against one plane into
+// out and returns its new vertex count, at most n + 1
+static int clip_polygon(const Eigen::Vector4f* in, int n, const Eigen::Vector4f& plane, Eigen::Vector4f* out)
+{
+    int count = 0;
+    for (int i = 0; i < n; ++i)
+    {
+        const Eigen::Vector4f& a = in[i];
+        const Eigen::Vector4f& b = in[(i + 1) % n];
+        float da = plane.dot(a), db = plane.dot(b);
+        if (da >= 0)
+            out[count++] = a;
+        if ((da >= 0) != (db >= 0))
+            out[count++] = a + da / (da - db) * (b - a);
+    }
+    return count;
+}
+
+// Sets up the fixed-point edge functions of the screen space triangle v, wound
+// so that the inside is positive; edge[k] vanishes on the edge opposite vertex
+// k. Returns false for triangles without area and for ones reaching past the
+// guard band the fixed-point range covers.
+static bool setup_edges(const Vector3f* v, std::array<edge_eq, 3>& edge, float& inv_area)
+{
+    constexpr int SUBPIXEL = 16;
+
+    int64_t x[3], y[3];
+    for (int k = 0; k < 3; ++k)
+    {
+        if (!(std::abs(v[k].x()) < GUARD_BAND && std::abs(v[k].y()) < GUARD_BAND))
+            return false;
+        x[k] = std::lround(v[k].x() * SUBPIXEL);
+        y[k] = std::lround(v[k].y() * SUBPIXEL);
+    }
+
+    int64_t area = (x[1] - x[0]) * (y[2] - y[0]) - (x[2] - x[0]) * (y[1] - y[0]);
+    if (area == 0)
+        return false;
+    int64_t sign = area > 0 ? 1 : -1;
+
+    for (int k = 0; k < 3; ++k)
+    {
+        int j = (k + 1) % 3, l = (k + 2) % 3;
+        int64_t a = sign * (y[j] - y[l]);
+        int64_t b = sign * (x[l] - x[j]);
+        int64_t c = sign * (x[j] * y[l] - x[l] * y[j]);
+        // pixel centers exactly on an edge only belong to its left or top side
+        bool top_left = a > 0 || (a == 0 && b < 0);
+        edge[k].a = (int32_t)(a * SUBPIXEL);
+        edge[k].b = (int32_t)(b * SUBPIXEL);
+        edge[k].c = c + (a + b) * (SUBPIXEL / 2) - (top_left ? 0 : 1);
+    }
+    inv_area = (float)(1.0 / (double)(area * sign));
+    return true;
+}
+
+// An MSAA sample's color, 8 bits per channel: red in the low byte
+static uint32_t pack_color(const Eigen::Vector3f& color)
+{
+    uint32_t packed = 0;
+    for (int c = 0; c < 3; ++c)
+        packed |= (uint32_t)std::lround(std::min(std::max(color[c], 0.0f), 255.0f)) << 8 * c;
+    return packed;
 }
 
 void rst::rasterizer::draw(pos_buf_id pos_buffer, ind_buf_id ind_buffer, col_buf_id col_buffer, Primitive type)
 {
-    auto& buf = pos_buf[pos_buffer.pos_id];
-    auto& ind = ind_buf[ind_buffer.ind_id];
-    auto& col = col_buf[col_buffer.col_id];
+    auto buf = buffer<Eigen::Vector3f>(pos_buffer.pos_id);
+    auto ind = buffer<Eigen::Vector3i>(ind_buffer.ind_id);
+    auto col = buffer<Eigen::Vector3f>(col_buffer.col_id);
+    check_indices(ind, std::min(buf.count, col.count));
 
     float f1 = (50 - 0.1) / 2.0;
     float f2 = (50 + 0.1) / 2.0;
 
     Eigen::Matrix4f mvp = projection * view * model;
+    auto planes = clip_planes(width, height);
     for (auto& i : ind)
     {
-        Triangle t;
         Eigen::Vector4f v[] = {
                 mvp * to_vec4(buf[i[0]], 1.0f),
                 mvp * to_vec4(buf[i[1]], 1.0f),
                 mvp * to_vec4(buf[i[2]], 1.0f)
         };
+
+        // frustum culling: every vertex outside the same plane
+        int code[3] = {0, 0, 0};
+        for (int k = 0; k < 3; ++k)
+            for (int plane = 0; plane < NUM_CLIP_PLANES; ++plane)
+                code[k] |= (planes[plane].dot(v[k]) < 0) << plane;
+        if (code[0] & code[1] & code[2] & CLIP_FRUSTUM)
+            continue;
+        if (culling == Culling::Back && facing(v) <= 0)
+            continue;
+
+        // Clip against the planes some vertex is outside of, each adding at
+        // most one vertex, and fan the convex result out from its first vertex
+        Eigen::Vector4f poly[2][3 + NUM_CLIP_PLANES] = {{v[0], v[1], v[2]}};
+        int n = 3, cur = 0;
+        int crossed = (code[0] | code[1] | code[2]) & CLIP_NEEDED;
+        for (int plane = 0; plane < NUM_CLIP_PLANES && n >= 3; ++plane)
+        {
+            if (!(crossed >> plane & 1))
+                continue;
+            n = clip_polygon(poly[cur], n, planes[plane], poly[1 - cur]);
+            cur = 1 - cur;
+        }
+
         //Homogeneous division
-        for (auto& vec : v) {
-            vec /= vec.w();
+        for (int k = 0; k < n; ++k) {
+            poly[cur][k] /= poly[cur][k].w();
         }
         //Viewport transformation
-        for (auto & vert : v)
+        for (int k = 0; k < n; ++k)
         {
+            auto& vert = poly[cur][k];
             vert.x() = 0.5*width*(vert.x()+1.0);
             vert.y() = 0.5*height*(vert.y()+1.0);
             vert.z() = vert.z() * f1 + f2;
         }
 
-        for (int i = 0; i < 3; ++i)
+        // one flat color per triangle, that of its first vertex
+        const Eigen::Vector3f& color = col[i[0]];
+        for (int k = 1; k + 1 < n; ++k)
         {
-            t.setVertex(i, v[i].head<3>());
-            t.setVertex(i, v[i].head<3>());
-            t.setVertex(i, v[i].head<3>());
+            Eigen::Vector3f fan[] = {poly[cur][0].head<3>(), poly[cur][k].head<3>(), poly[cur][k + 1].head<3>()};
+            rasterize_triangle(fan, color);
         }
+    }
 
-        auto col_x = col[i[0]];
-        auto col_y = col[i[1]];
-        auto col_z = col[i[2]];
+    if (samples > 1)
+        resolve();
+}
+
+//Screen space rasterization
+//
+// The bounding box is walked in 8x8 blocks. The four corners of a block decide
+// it against each edge: blocks outside any edge are skipped, blocks inside all
+// three need no coverage test, and only partially covered blocks evaluate the
+// crossing edges per pixel, one 8-wide row at a time.
+void rst::rasterizer::rasterize_triangle(const Eigen::Vector3f* v, const Eigen::Vector3f& color) {
+    std::array<edge_eq, 3> edge;
+    float inv_area;
+    if (!setup_edges(v, edge, inv_area))
+        return;
 
-        t.setColor(0, col_x[0], col_x[1], col_x[2]);
-        t.setColor(1, col_y[0], col_y[1], col_y[2]);
-        t.setColor(2, col_z[0], col_z[1], col_z[2]);
+    // ҳǰεı߽bounding boxĻΧڣҡϱ߽粻
+    int x_min = std::max(0, (int)std::floor(std::min({v[0].x(), v[1].x(), v[2].x()})));
+    int x_max = std::min(width, (int)std::floor(std::max({v[0].x(), v[1].x(), v[2].x()})) + 1);
+    int y_min = std::max(0, (int)std::floor(std::min({v[0].y(), v[1].y(), v[2].y()})));
+    int y_max = std::min(height, (int)std::floor(std::max({v[0].y(), v[1].y(), v[2].y()})) + 1);
 
-        rasterize_triangle(t);
+    // Sample k sits at SAMPLE_OFFSET[k] from the pixel center, in 1/16 pixels
+    // (the edge functions' subpixel units): the rotated grid of 4x MSAA, or
+    // the center itself without MSAA. Edge and depth values at a sample are
+    // those at the center plus a fixed offset per triangle.
+    static const int SAMPLE_OFFSET[MSAA_SAMPLES][2] = {{-2, -6}, {6, -2}, {-6, 2}, {2, 6}};
+    static const int CENTER_OFFSET[1][2] = {{0, 0}};
+    const auto* offset = samples == 1 ? CENTER_OFFSET : SAMPLE_OFFSET;
+    const int num_pixels = width * height;
+
+    int32_t edge_offset[3][MSAA_SAMPLES];
+    int32_t min_offset[3], max_offset[3];
+    for (int k = 0; k < 3; ++k) {
+        min_offset[k] = max_offset[k] = 0;
+        for (int s = 0; s < samples; ++s) {
+            edge_offset[k][s] = edge[k].a / 16 * offset[s][0] + edge[k].b / 16 * offset[s][1];
+            min_offset[k] = std::min(min_offset[k], edge_offset[k][s]);
+            max_offset[k] = std::max(max_offset[k], edge_offset[k][s]);
+        }
     }
-}
+    // depth plane gradient per 1/16 pixel, for the sample offsets
+    float dz1 = v[1].z() - v[0].z(), dz2 = v[2].z() - v[0].z();
+    float zdx = (edge[1].a * dz1 + edge[2].a * dz2) * inv_area / 16;
+    float zdy = (edge[1].b * dz1 + edge[2].b * dz2) * inv_area / 16;
+    float depth_offset[MSAA_SAMPLES];
+    for (int s = 0; s < samples; ++s)
+        depth_offset[s] = zdx * offset[s][0] + zdy * offset[s][1];
+    const simd::i32x8 packed = simd::splat((int32_t)pack_color(color));
 
-//Screen space rasterization
-void rst::rasterizer::rasterize_triangle(const Triangle& t) {
-    auto v = t.toVector4();
-    
-    // ҳǰεı߽bounding box
-    float min_x = std::min({v[0].x(), v[1].x(), v[2].x()});
-    float max_x = std::max({v[0].x(), v[1].x(), v[2].x()});
-    float min_y = std::min({v[0].y(), v[1].y(), v[2].y()});
-    float max_y = std::max({v[0].y(), v[1].y(), v[2].y()});
-    
-    // ߽ĻΧ
-    int x_min = std::max(0, (int)std::floor(min_x));
-    int x_max = std::min(width - 1, (int)std::ceil(max_x));
-    int y_min = std::max(0, (int)std::floor(min_y));
-    int y_max = std::min(height - 1, (int)std::ceil(max_y));
-    
-    // ߽ڵÿ
-    for (int x = x_min; x <= x_max; x++) {
-        for (int y = y_min; y <= y_max; y++) {
-            // жϵǰǷ
-            if (insideTriangle(x + 0.5, y + 0.5, t.v)) {
-                // ڣֵzֵ
-                auto barycentric = computeBarycentric2D(x + 0.5, y + 0.5, t.v);
-                float alpha = std::get<0>(barycentric);
-                float beta = std::get<1>(barycentric);
-                float gamma = std::get<2>(barycentric);
-                float w_reciprocal = 1.0 / (alpha / v[0].w() + beta / v[1].w() + gamma / v[2].w());
-                float z_interpolated = alpha * v[0].z() / v[0].w() + beta * v[1].z() / v[1].w() + gamma * v[2].z() / v[2].w();
-                z_interpolated *= w_reciprocal;
-                
-                // Ȳ
-                int index = get_index(x, y);
-                if (z_interpolated < depth_buf[index]) {
-                    // Ȼ
-                    depth_buf[index] = z_interpolated;
-                    // ɫ
-                    set_pixel(Vector3f(x, y, z_interpolated), t.getColor());
+    constexpr int BLOCK_SIZE = simd::WIDTH;
+    const int last = BLOCK_SIZE - 1;
+    for (int by = y_min & ~last; by < y_max; by += BLOCK_SIZE) {
+        for (int bx = x_min & ~last; bx < x_max; bx += BLOCK_SIZE) {
+            // the corners decide the block for every sample position at once
+            int partial = 0;
+            bool outside = false;
+            for (int k = 0; k < 3 && !outside; ++k) {
+                int64_t c00 = edge[k].at(bx, by);
+                int64_t c10 = c00 + (int64_t)edge[k].a * last;
+                int64_t c01 = c00 + (int64_t)edge[k].b * last;
+                int64_t c11 = c10 + (int64_t)edge[k].b * last;
+                int64_t lo = std::min({c00, c10, c01, c11}), hi = std::max({c00, c10, c01, c11});
+                outside = hi + max_offset[k] < 0;
+                partial |= (lo + min_offset[k] < 0) << k;
+            }
+            if (outside)
+                continue;
+
+            int lane_begin = std::max(bx, x_min) - bx;
+            int lane_end = std::min(bx + BLOCK_SIZE, x_max) - bx;
+            int lanes = ((1 << lane_end) - 1) & ~((1 << lane_begin) - 1);
+
+            int row_begin = std::max(by, y_min), row_end = std::min(by + BLOCK_SIZE, y_max);
+            int64_t row[3];
+            for (int k = 0; k < 3; ++k)
+                row[k] = edge[k].at(bx, row_begin);
+
+            for (int y = row_begin; y < row_end; ++y) {
+                // жһ8صÿǷڣֻԴÿıߣ
+                int sample_mask[MSAA_SAMPLES];
+                int any = 0;
+                for (int s = 0; s < samples; ++s) {
+                    sample_mask[s] = lanes;
+                    if (partial) {
+                        simd::i32x8 e = simd::splat(0);
+                        for (int k = 0; k < 3; ++k)
+                            if (partial >> k & 1)
+                                e = e | simd::ramp((int32_t)row[k] + edge_offset[k][s], edge[k].a);
+                        sample_mask[s] &= ~simd::sign_mask(e);
+                    }
+                    any |= sample_mask[s];
+                }
+
+                if (any) {
+                    // 㣬ĻռԲֵģ
+                    simd::f32x8 beta = simd::ramp((float)row[1] * inv_area, edge[1].a * inv_area);
+                    simd::f32x8 gamma = simd::ramp((float)row[2] * inv_area, edge[2].a * inv_area);
+                    simd::f32x8 z_row = simd::splat(v[0].z()) + simd::splat(dz1) * beta + simd::splat(dz2) * gamma;
+
+                    // Ȳԣһ8
+                    // With MSAA the color goes to the samples that pass in the
+                    // same masked stores as the depth, so each triangle is still
+                    // shaded once per pixel but never written lane by lane
+                    int index = get_index(bx, y);
+                    int any_written = 0;
+                    for (int s = 0; s < samples; ++s) {
+                        float* depth = &depth_buf[s * num_pixels + index];
+                        simd::f32x8 z = z_row + simd::splat(depth_offset[s]);
+                        int written = sample_mask[s] & simd::less_mask(z, simd::load(depth));
+                        if (!written)
+                            continue;
+                        // Ȼ
+                        simd::store(depth, z, written);
+                        if (samples > 1)
+                            simd::store(&sample_buf[s * num_pixels + index], packed, written);
+                        any_written |= written;
+                    }
+
+                    if (samples == 1)
+                        for (int lane = 0; lane < BLOCK_SIZE; ++lane)
+                            if (any_written >> lane & 1)
+                                frame_buf[index + lane] = color;
                 }
+
+                for (int k = 0; k < 3; ++k)
+                    row[k] += edge[k].b;
             }
         }
     }
 }
 
+// One run_parallel call: its workers are claimed one at a time, by the
+// calling thread and by any pool thread that picks the call up
+struct parallel_job
+{
+    const std::function<void(int)>* job;
+    int num_workers;
+    std::atomic<int> next_worker{1};
+    std::mutex mutex;
+    std::condition_variable finished;
+    int num_done = 0;
+
+    // runs unclaimed workers until there are none left
+    void work()
+    {
+        for (int w = next_worker++; w < num_workers; w = next_worker++)
+        {
+            (*job)(w);
+            std::lock_guard<std::mutex> lock(mutex);
+            if (++num_done == num_workers - 1)
+                finished.notify_one();
+        }
+    }
+};
+
+// Threads started once and kept for the life of the program, shared by every
+// rasterizer, so a draw does not start and join threads for each of its
+// phases. Several rasterizers may run jobs at once: a pool thread takes
+// whichever job was queued first, and a caller works on its own job too, so
+// it finishes even when every pool thread is busy elsewhere.
+class worker_pool
+{
+public:
+    worker_pool()
+    {
+        int n = std::max(1, (int)std::thread::hardware_concurrency() - 1);
+        for (int i = 0; i < n; ++i)
+            threads.emplace_back([this] { loop(); });
+    }
+    ~worker_pool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        ready.notify_all();
+        for (auto& t : threads)
+            t.join();
+    }
+
+    static worker_pool& instance()
+    {
+        static worker_pool pool;
+        return pool;
+    }
+
+    // Offers pj to up to count pool threads
+    void submit(const std::shared_ptr<parallel_job>& pj, int count)
+    {
+        count = std::min(count, (int)threads.size());
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            for (int i = 0; i < count; ++i)
+                queue.push_back(pj);
+        }
+        if (count == 1)
+            ready.notify_one();
+        else
+            ready.notify_all();
+    }
+
+private:
+    void loop()
+    {
+        for (;;)
+        {
+            std::shared_ptr<parallel_job> pj;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                ready.wait(lock, [&] { return stopping || !queue.empty(); });
+                if (queue.empty())
+                    return;
+                pj = std::move(queue.front());
+                queue.pop_front();
+            }
+            pj->work();
+        }
+    }
+
+    std::vector<std::thread> threads;
+    std::mutex mutex;
+    std::condition_variable ready;
+    // a job is queued once per pool thread it is offered to, and held until
+    // the last of them has seen it
+    std::deque<std::shared_ptr<parallel_job>> queue;
+    bool stopping = false;
+};
+
+void rst::rasterizer::run_parallel(int num_threads, const std::function<void(int)>& job)
+{
+    if (num_threads <= 1)
+    {
+        job(0);
+        return;
+    }
+
+    auto pj = std::make_shared<parallel_job>();
+    pj->job = &job;
+    pj->num_workers = num_threads;
+    worker_pool::instance().submit(pj, num_threads - 1);
+    job(0);
+    pj->work();
+    std::unique_lock<std::mutex> lock(pj->mutex);
+    pj->finished.wait(lock, [&] { return pj->num_done == num_threads - 1; });
+}
+
+void rst::rasterizer::resolve()
+{
+    // below RESOLVE_PIXELS_PER_THREAD pixels a thread costs more than it saves
+    const int num_pixels = width * height;
+    int num_threads = std::clamp(num_pixels / RESOLVE_PIXELS_PER_THREAD, 1,
+                                 (int)std::max(1u, std::thread::hardware_concurrency()));
+    run_parallel(num_threads, [this, num_threads, num_pixels](int worker) {
+        int begin = (int)((long long)num_pixels * worker / num_threads);
+        int end = (int)((long long)num_pixels * (worker + 1) / num_threads);
+        for (int i = begin; i < end; ++i) {
+            uint32_t s0 = sample_buf[i];
+            uint32_t s1 = sample_buf[i + num_pixels];
+            uint32_t s2 = sample_buf[i + 2 * num_pixels];
+            uint32_t s3 = sample_buf[i + 3 * num_pixels];
+            // inside a triangle all samples match and need no averaging
+            if (s0 == s1 && s0 == s2 && s0 == s3) {
+                frame_buf[i] = {(float)(s0 & 0xff), (float)(s0 >> 8 & 0xff), (float)(s0 >> 16 & 0xff)};
+                continue;
+            }
+            Eigen::Vector3f sum;
+            for (int c = 0; c < 3; ++c)
+                sum[c] = (float)((s0 >> 8 * c & 0xff) + (s1 >> 8 * c & 0xff) + (s2 >> 8 * c & 0xff) + (s3 >> 8 * c & 0xff));
+            frame_buf[i] = sum / MSAA_SAMPLES;
+        }
+    });
+}
+
+void rst::rasterizer::set_msaa(bool enabled)
+{
+    samples = enabled ? MSAA_SAMPLES : 1;
+    depth_buf.assign(width * height * samples + simd::WIDTH, std::numeric_limits<float>::infinity());
+    sample_buf.assign(enabled ? width * height * samples : 0, 0);
+}
+
 void rst::rasterizer::set_model(const Eigen::Matrix4f& m)
 {
     model = m;
@@ -193,6 +578,7 @@ void rst::rasterizer::clear(rst::Buffers buff)
     if ((buff & rst::Buffers::Color) == rst::Buffers::Color)
     {
         std::fill(frame_buf.begin(), frame_buf.end(), Eigen::Vector3f{0, 0, 0});
+        std::fill(sample_buf.begin(), sample_buf.end(), 0);
     }
     if ((buff & rst::Buffers::Depth) == rst::Buffers::Depth)
     {
@@ -203,7 +589,7 @@ void rst::rasterizer::clear(rst::Buffers buff)
 rst::rasterizer::rasterizer(int w, int h) : width(w), height(h)
 {
     frame_buf.resize(w * h);
-    depth_buf.resize(w * h);
+    depth_buf.resize(w * h + simd::WIDTH);
 }
 
 int rst::rasterizer::get_index(int x, int y)
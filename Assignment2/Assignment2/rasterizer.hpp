@@ -6,6 +6,13 @@
 
 #include <Eigen/Eigen>
 #include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <stdexcept>
+#include <typeinfo>
+#include <vector>
 #include "global.hpp"
 #include "Triangle.hpp"
 using namespace Eigen;
@@ -34,6 +41,14 @@ namespace rst
         Triangle
     };
 
+    // Back culls triangles wound clockwise on screen, which a closed mesh with
+    // counter-clockwise front faces only shows from behind
+    enum class Culling
+    {
+        None,
+        Back
+    };
+
     /*
      * For the curious : The draw function takes two buffer id's as its arguments. These two structs
      * make sure that if you mix up with their orders, the compiler won't compile it.
@@ -54,6 +69,18 @@ namespace rst
         int col_id = 0;
     };
 
+    // count elements at data, the contents of a buffer
+    template <typename T>
+    struct buffer_span
+    {
+        T* data = nullptr;
+        size_t count = 0;
+
+        T* begin() const { return data; }
+        T* end() const { return data + count; }
+        T& operator[](size_t i) const { return data[i]; }
+    };
+
     class rasterizer
     {
     public:
@@ -62,10 +89,29 @@ namespace rst
         ind_buf_id load_indices(const std::vector<Eigen::Vector3i>& indices);
         col_buf_id load_colors(const std::vector<Eigen::Vector3f>& colors);
 
+        // Zero-copy upload: the buffer is the caller's memory itself, which draw
+        // reads in place, so it has to stay alive and in place while in use
+        pos_buf_id register_positions(buffer_span<const Eigen::Vector3f> positions);
+        ind_buf_id register_indices(buffer_span<const Eigen::Vector3i> indices);
+        col_buf_id register_colors(buffer_span<const Eigen::Vector3f> colors);
+
+        // Persistent mapping of a loaded buffer: its storage never moves, so the
+        // span stays valid as long as the rasterizer and what is written through
+        // it is what the next draw reads, without loading the data again
+        buffer_span<Eigen::Vector3f> map_positions(pos_buf_id pos_buffer);
+        buffer_span<Eigen::Vector3i> map_indices(ind_buf_id ind_buffer);
+        buffer_span<Eigen::Vector3f> map_colors(col_buf_id col_buffer);
+
         void set_model(const Eigen::Matrix4f& m);
         void set_view(const Eigen::Matrix4f& v);
         void set_projection(const Eigen::Matrix4f& p);
 
+        void set_culling(Culling mode) { culling = mode; }
+        // 4x MSAA: coverage and depth are tested at MSAA_SAMPLES points per pixel,
+        // but each triangle is still shaded once per pixel and draw resolves the
+        // samples into frame_buffer() when it is done
+        void set_msaa(bool enabled);
+
         void set_pixel(const Eigen::Vector3f& point, const Eigen::Vector3f& color);
 
         void clear(Buffers buff);
@@ -77,7 +123,13 @@ namespace rst
     private:
         void draw_line(Eigen::Vector3f begin, Eigen::Vector3f end);
 
-        void rasterize_triangle(const Triangle& t);
+        // v is the screen space triangle, drawn in one flat color
+        void rasterize_triangle(const Eigen::Vector3f* v, const Eigen::Vector3f& color);
+        // Averages the samples of every pixel into frame_buf
+        void resolve();
+        // Runs job(worker) for worker in [0, num_threads), worker 0 on the calling
+        // thread and the others on a pool of threads kept across draws
+        static void run_parallel(int num_threads, const std::function<void(int)>& job);
 
         // VERTEX SHADER -> MVP -> Clipping -> /.W -> VIEWPORT -> DRAWLINE/DRAWTRI -> FRAGSHADER
 
@@ -86,18 +138,73 @@ namespace rst
         Eigen::Matrix4f view;
         Eigen::Matrix4f projection;
 
-        std::map<int, std::vector<Eigen::Vector3f>> pos_buf;
-        std::map<int, std::vector<Eigen::Vector3i>> ind_buf;
-        std::map<int, std::vector<Eigen::Vector3f>> col_buf;
+        Culling culling = Culling::None;
+
+        // The buffer objects, indexed by the ids of their handles. Positions,
+        // indices and colors share the table, so each records its element type
+        // for lookups to check; storage owns the data of loaded buffers and is
+        // null for registered ones.
+        struct buffer_object
+        {
+            std::shared_ptr<void> storage;
+            void* data;
+            size_t count;
+            // what the buffer was created with, checked on every lookup
+            const std::type_info* type;
+            size_t element_size;
+        };
+        std::vector<buffer_object> buffers;
+
+        template <typename T>
+        int load_buffer(const std::vector<T>& values);
+        template <typename T>
+        int register_buffer(buffer_span<const T> values);
+        template <typename T>
+        buffer_span<T> map_buffer(int id);
+        // The buffer with this id, which must hold elements of type T. Throws for
+        // an id that was never issued or a handle of another element type, which
+        // would otherwise read past the end of the buffer.
+        template <typename T>
+        const buffer_object& checked_buffer(int id) const
+        {
+            if (id < 0 || id >= (int)buffers.size())
+                throw std::runtime_error("No buffer has this id");
+            const buffer_object& b = buffers[id];
+            if (*b.type != typeid(T) || b.element_size != sizeof(T))
+                throw std::runtime_error("The buffer holds elements of another type");
+            return b;
+        }
+        // Throws unless every index addresses one of the count elements of the
+        // buffers it is read from, checked once per draw
+        static void check_indices(buffer_span<const Eigen::Vector3i> ind, size_t count)
+        {
+            for (const auto& i : ind)
+                if (i.minCoeff() < 0 || (size_t)i.maxCoeff() >= count)
+                    throw std::runtime_error("An index is out of range of the buffer it reads");
+        }
+        // The elements of a buffer, resolved once per draw
+        template <typename T>
+        buffer_span<const T> buffer(int id) const
+        {
+            const buffer_object& b = checked_buffer<T>(id);
+            return {static_cast<const T*>(b.data), b.count};
+        }
 
         std::vector<Eigen::Vector3f> frame_buf;
 
+        // one depth per sample: width * height for sample 0, then for sample 1, ...
+        // padded by simd::WIDTH so a row of 8 can be loaded at the right edge
         std::vector<float> depth_buf;
         int get_index(int x, int y);
 
-        int width, height;
+        static constexpr int MSAA_SAMPLES = 4;
+        // resolve gives each thread at least this many pixels
+        static constexpr int RESOLVE_PIXELS_PER_THREAD = 64 * 1024;
+        int samples = 1;
+        // MSAA only: the color of every sample, laid out like depth_buf, packed
+        // 8 bits per channel so that 8 pixels of a sample take one SIMD store
+        std::vector<uint32_t> sample_buf;
 
-        int next_id = 0;
-        int get_next_id() { return next_id++; }
+        int width, height;
     };
 }
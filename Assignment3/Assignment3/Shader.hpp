@@ -5,7 +5,10 @@
 #ifndef RASTERIZER_SHADER_H
 #define RASTERIZER_SHADER_H
 #include <Eigen/Dense>
+#include <cassert>
+#include <typeinfo>
 #include "Texture.hpp"
+#include "Simd.hpp"
 
 
 struct fragment_shader_payload
@@ -15,7 +18,7 @@ struct fragment_shader_payload
         texture = nullptr;
     }
 
-    fragment_shader_payload(const Eigen::Vector3f& col, const Eigen::Vector3f& nor,const Eigen::Vector2f& tc, Texture* tex) :
+    fragment_shader_payload(const Eigen::Vector3f& col, const Eigen::Vector3f& nor,const Eigen::Vector2f& tc, const Texture* tex) :
          color(col), normal(nor), tex_coords(tc), texture(tex) {}
 
 
@@ -23,7 +26,47 @@ struct fragment_shader_payload
     Eigen::Vector3f color;
     Eigen::Vector3f normal;
     Eigen::Vector2f tex_coords;
-    Texture* texture;
+    // screen-space derivatives of tex_coords along x and y, for the mip level
+    Eigen::Vector2f tex_dx, tex_dy;
+    const Texture* texture;
+    const void* uniform_block = nullptr;
+    // of the block, as bound
+    const std::type_info* uniform_type = nullptr;
+
+    // The block bound with rst::rasterizer::set_uniforms, which must be a T;
+    // debug builds check that it was bound and is one
+    template <typename T>
+    const T& uniforms() const
+    {
+        assert(uniform_block && "no uniforms bound with set_uniforms");
+        assert(*uniform_type == typeid(T) && "the uniforms bound are of another type");
+        return *static_cast<const T*>(uniform_block);
+    }
+};
+
+// Eight fragments in SoA form, for shaders that work on whole packets. Lane i
+// holds a fragment only if bit i of mask is set; the other lanes carry
+// arbitrary values and whatever the shader returns for them is dropped.
+struct fragment_packet
+{
+    simd::vec3x8 view_pos;
+    simd::vec3x8 color;
+    simd::vec3x8 normal;
+    simd::f32x8 tex_u, tex_v;
+    // screen-space derivatives of tex_u and tex_v along x and y
+    simd::f32x8 tex_du_dx, tex_dv_dx, tex_du_dy, tex_dv_dy;
+    int mask;
+    const Texture* texture;
+    const void* uniform_block = nullptr;
+    const std::type_info* uniform_type = nullptr;
+
+    template <typename T>
+    const T& uniforms() const
+    {
+        assert(uniform_block && "no uniforms bound with set_uniforms");
+        assert(*uniform_type == typeid(T) && "the uniforms bound are of another type");
+        return *static_cast<const T*>(uniform_block);
+    }
 };
 
 struct vertex_shader_payload
@@ -0,0 +1,218 @@
+//
+// 8-wide lanes for the rasterizer inner loops.
+//
+// When the compiler targets AVX2 (/arch:AVX2, -mavx2) every type is a single
+// ymm register; otherwise the lanes are plain arrays and the loops below are
+// left for the compiler to vectorize with whatever it has (SSE, NEON).
+//
+// The 8-wide speedups need that flag. The x64 configurations of the Visual
+// Studio project, Debug and Release, set it (Enable Enhanced Instruction
+// Set: AVX2); Win32 builds, and other compilers without -mavx2, get the
+// array fallback.
+//
+
+#pragma once
+
+#include <cstdint>
+#include <cmath>
+#include <cstring>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+namespace simd
+{
+    constexpr int WIDTH = 8;
+
+#if defined(__AVX2__)
+
+    struct i32x8 { __m256i v; };
+    struct f32x8 { __m256 v; };
+
+    inline i32x8 splat(int32_t a) { return {_mm256_set1_epi32(a)}; }
+    inline f32x8 splat(float a) { return {_mm256_set1_ps(a)}; }
+
+    // lane i holds base + i * step
+    inline i32x8 ramp(int32_t base, int32_t step)
+    {
+        __m256i lane = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+        return {_mm256_add_epi32(_mm256_set1_epi32(base), _mm256_mullo_epi32(lane, _mm256_set1_epi32(step)))};
+    }
+    inline f32x8 ramp(float base, float step)
+    {
+        __m256 lane = _mm256_setr_ps(0, 1, 2, 3, 4, 5, 6, 7);
+        return {_mm256_add_ps(_mm256_set1_ps(base), _mm256_mul_ps(lane, _mm256_set1_ps(step)))};
+    }
+
+    inline i32x8 operator+(i32x8 a, i32x8 b) { return {_mm256_add_epi32(a.v, b.v)}; }
+    inline i32x8 operator-(i32x8 a, i32x8 b) { return {_mm256_sub_epi32(a.v, b.v)}; }
+    inline i32x8 operator*(i32x8 a, i32x8 b) { return {_mm256_mullo_epi32(a.v, b.v)}; }
+    inline i32x8 operator|(i32x8 a, i32x8 b) { return {_mm256_or_si256(a.v, b.v)}; }
+    inline i32x8 operator&(i32x8 a, i32x8 b) { return {_mm256_and_si256(a.v, b.v)}; }
+    inline i32x8 operator<<(i32x8 a, int n) { return {_mm256_slli_epi32(a.v, n)}; }
+    // logical shift
+    inline i32x8 operator>>(i32x8 a, int n) { return {_mm256_srli_epi32(a.v, n)}; }
+    // per-lane shift counts; counts outside [0, 32) give 0
+    inline i32x8 operator<<(i32x8 a, i32x8 n) { return {_mm256_sllv_epi32(a.v, n.v)}; }
+    inline i32x8 operator>>(i32x8 a, i32x8 n) { return {_mm256_srlv_epi32(a.v, n.v)}; }
+    inline i32x8 min(i32x8 a, i32x8 b) { return {_mm256_min_epi32(a.v, b.v)}; }
+    inline i32x8 max(i32x8 a, i32x8 b) { return {_mm256_max_epi32(a.v, b.v)}; }
+    inline f32x8 operator+(f32x8 a, f32x8 b) { return {_mm256_add_ps(a.v, b.v)}; }
+    inline f32x8 operator-(f32x8 a, f32x8 b) { return {_mm256_sub_ps(a.v, b.v)}; }
+    inline f32x8 operator*(f32x8 a, f32x8 b) { return {_mm256_mul_ps(a.v, b.v)}; }
+    inline f32x8 operator/(f32x8 a, f32x8 b) { return {_mm256_div_ps(a.v, b.v)}; }
+
+    // b when either is NaN
+    inline f32x8 min(f32x8 a, f32x8 b) { return {_mm256_min_ps(a.v, b.v)}; }
+    inline f32x8 max(f32x8 a, f32x8 b) { return {_mm256_max_ps(a.v, b.v)}; }
+    inline f32x8 sqrt(f32x8 a) { return {_mm256_sqrt_ps(a.v)}; }
+    inline f32x8 floor(f32x8 a) { return {_mm256_floor_ps(a.v)}; }
+
+    // bit i is set when lane i is negative
+    inline int sign_mask(i32x8 a) { return _mm256_movemask_ps(_mm256_castsi256_ps(a.v)); }
+    // bit i is set when a[i] < b[i]
+    inline int less_mask(f32x8 a, f32x8 b) { return _mm256_movemask_ps(_mm256_cmp_ps(a.v, b.v, _CMP_LT_OQ)); }
+
+    // rounds to nearest, ties to even
+    inline i32x8 to_int(f32x8 a) { return {_mm256_cvtps_epi32(a.v)}; }
+    // rounds toward zero
+    inline i32x8 truncate(f32x8 a) { return {_mm256_cvttps_epi32(a.v)}; }
+    inline f32x8 to_float(i32x8 a) { return {_mm256_cvtepi32_ps(a.v)}; }
+    // the same 32 bits, reinterpreted
+    inline i32x8 as_int(f32x8 a) { return {_mm256_castps_si256(a.v)}; }
+    inline f32x8 as_float(i32x8 a) { return {_mm256_castsi256_ps(a.v)}; }
+
+    // lane i loads base[index[i]]
+    inline i32x8 gather(const int32_t* base, i32x8 index) { return {_mm256_i32gather_epi32((const int*)base, index.v, 4)}; }
+    inline f32x8 gather(const float* base, i32x8 index) { return {_mm256_i32gather_ps(base, index.v, 4)}; }
+    // sign-extended; reads 32 bits at each, so base[index[i] + 1] must exist too
+    inline i32x8 gather(const int16_t* base, i32x8 index)
+    {
+        __m256i pair = _mm256_i32gather_epi32((const int*)base, index.v, 2);
+        return {_mm256_srai_epi32(_mm256_slli_epi32(pair, 16), 16)};
+    }
+
+    inline f32x8 load(const float* p) { return {_mm256_loadu_ps(p)}; }
+    inline void store(float* p, f32x8 a) { _mm256_storeu_ps(p, a.v); }
+    inline void store(int32_t* p, i32x8 a) { _mm256_storeu_si256((__m256i*)p, a.v); }
+
+    // all ones in lane i when bit i of mask is set
+    inline __m256i lane_mask(int mask)
+    {
+        __m256i bit = _mm256_setr_epi32(1, 2, 4, 8, 16, 32, 64, 128);
+        return _mm256_cmpeq_epi32(_mm256_and_si256(_mm256_set1_epi32(mask), bit), bit);
+    }
+    // Only the lanes in mask touch memory: the others load as 0 and are not
+    // stored, so p[i] outside mask may be out of bounds or another thread's
+    inline f32x8 load(const float* p, int mask) { return {_mm256_maskload_ps(p, lane_mask(mask))}; }
+    inline void store(float* p, f32x8 a, int mask) { _mm256_maskstore_ps(p, lane_mask(mask), a.v); }
+
+#else
+
+    struct i32x8 { int32_t v[WIDTH]; };
+    struct f32x8 { float v[WIDTH]; };
+
+    inline i32x8 splat(int32_t a) { i32x8 r; for (int i = 0; i < WIDTH; ++i) r.v[i] = a; return r; }
+    inline f32x8 splat(float a) { f32x8 r; for (int i = 0; i < WIDTH; ++i) r.v[i] = a; return r; }
+
+    // lane i holds base + i * step
+    inline i32x8 ramp(int32_t base, int32_t step) { i32x8 r; for (int i = 0; i < WIDTH; ++i) r.v[i] = base + i * step; return r; }
+    inline f32x8 ramp(float base, float step) { f32x8 r; for (int i = 0; i < WIDTH; ++i) r.v[i] = base + i * step; return r; }
+
+    inline i32x8 operator+(i32x8 a, i32x8 b) { for (int i = 0; i < WIDTH; ++i) a.v[i] += b.v[i]; return a; }
+    inline i32x8 operator-(i32x8 a, i32x8 b) { for (int i = 0; i < WIDTH; ++i) a.v[i] -= b.v[i]; return a; }
+    inline i32x8 operator*(i32x8 a, i32x8 b) { for (int i = 0; i < WIDTH; ++i) a.v[i] *= b.v[i]; return a; }
+    inline i32x8 operator|(i32x8 a, i32x8 b) { for (int i = 0; i < WIDTH; ++i) a.v[i] |= b.v[i]; return a; }
+    inline i32x8 operator&(i32x8 a, i32x8 b) { for (int i = 0; i < WIDTH; ++i) a.v[i] &= b.v[i]; return a; }
+    inline i32x8 operator<<(i32x8 a, int n) { for (int i = 0; i < WIDTH; ++i) a.v[i] = (int32_t)((uint32_t)a.v[i] << n); return a; }
+    // logical shift
+    inline i32x8 operator>>(i32x8 a, int n) { for (int i = 0; i < WIDTH; ++i) a.v[i] = (int32_t)((uint32_t)a.v[i] >> n); return a; }
+    // per-lane shift counts; counts outside [0, 32) give 0
+    inline i32x8 operator<<(i32x8 a, i32x8 n) { for (int i = 0; i < WIDTH; ++i) a.v[i] = (uint32_t)n.v[i] < 32 ? (int32_t)((uint32_t)a.v[i] << n.v[i]) : 0; return a; }
+    inline i32x8 operator>>(i32x8 a, i32x8 n) { for (int i = 0; i < WIDTH; ++i) a.v[i] = (uint32_t)n.v[i] < 32 ? (int32_t)((uint32_t)a.v[i] >> n.v[i]) : 0; return a; }
+    inline i32x8 min(i32x8 a, i32x8 b) { for (int i = 0; i < WIDTH; ++i) a.v[i] = b.v[i] < a.v[i] ? b.v[i] : a.v[i]; return a; }
+    inline i32x8 max(i32x8 a, i32x8 b) { for (int i = 0; i < WIDTH; ++i) a.v[i] = b.v[i] > a.v[i] ? b.v[i] : a.v[i]; return a; }
+    inline f32x8 operator+(f32x8 a, f32x8 b) { for (int i = 0; i < WIDTH; ++i) a.v[i] += b.v[i]; return a; }
+    inline f32x8 operator-(f32x8 a, f32x8 b) { for (int i = 0; i < WIDTH; ++i) a.v[i] -= b.v[i]; return a; }
+    inline f32x8 operator*(f32x8 a, f32x8 b) { for (int i = 0; i < WIDTH; ++i) a.v[i] *= b.v[i]; return a; }
+    inline f32x8 operator/(f32x8 a, f32x8 b) { for (int i = 0; i < WIDTH; ++i) a.v[i] /= b.v[i]; return a; }
+
+    // b when either is NaN
+    inline f32x8 min(f32x8 a, f32x8 b) { for (int i = 0; i < WIDTH; ++i) a.v[i] = a.v[i] < b.v[i] ? a.v[i] : b.v[i]; return a; }
+    inline f32x8 max(f32x8 a, f32x8 b) { for (int i = 0; i < WIDTH; ++i) a.v[i] = a.v[i] > b.v[i] ? a.v[i] : b.v[i]; return a; }
+    inline f32x8 sqrt(f32x8 a) { for (int i = 0; i < WIDTH; ++i) a.v[i] = std::sqrt(a.v[i]); return a; }
+    inline f32x8 floor(f32x8 a) { for (int i = 0; i < WIDTH; ++i) a.v[i] = std::floor(a.v[i]); return a; }
+
+    // bit i is set when lane i is negative
+    inline int sign_mask(i32x8 a) { int m = 0; for (int i = 0; i < WIDTH; ++i) m |= (a.v[i] < 0) << i; return m; }
+    // bit i is set when a[i] < b[i]
+    inline int less_mask(f32x8 a, f32x8 b) { int m = 0; for (int i = 0; i < WIDTH; ++i) m |= (a.v[i] < b.v[i]) << i; return m; }
+
+    // rounds to nearest, ties to even
+    inline i32x8 to_int(f32x8 a) { i32x8 r; for (int i = 0; i < WIDTH; ++i) r.v[i] = (int32_t)std::nearbyint(a.v[i]); return r; }
+    // rounds toward zero
+    inline i32x8 truncate(f32x8 a) { i32x8 r; for (int i = 0; i < WIDTH; ++i) r.v[i] = (int32_t)a.v[i]; return r; }
+    inline f32x8 to_float(i32x8 a) { f32x8 r; for (int i = 0; i < WIDTH; ++i) r.v[i] = (float)a.v[i]; return r; }
+    // the same 32 bits, reinterpreted
+    inline i32x8 as_int(f32x8 a) { i32x8 r; std::memcpy(r.v, a.v, sizeof(r.v)); return r; }
+    inline f32x8 as_float(i32x8 a) { f32x8 r; std::memcpy(r.v, a.v, sizeof(r.v)); return r; }
+
+    // lane i loads base[index[i]]
+    inline i32x8 gather(const int32_t* base, i32x8 index) { i32x8 r; for (int i = 0; i < WIDTH; ++i) r.v[i] = base[index.v[i]]; return r; }
+    inline f32x8 gather(const float* base, i32x8 index) { f32x8 r; for (int i = 0; i < WIDTH; ++i) r.v[i] = base[index.v[i]]; return r; }
+    // sign-extended; base[index[i] + 1] must exist too, as for AVX2
+    inline i32x8 gather(const int16_t* base, i32x8 index) { i32x8 r; for (int i = 0; i < WIDTH; ++i) r.v[i] = base[index.v[i]]; return r; }
+
+    inline f32x8 load(const float* p) { f32x8 r; for (int i = 0; i < WIDTH; ++i) r.v[i] = p[i]; return r; }
+    inline void store(float* p, f32x8 a) { for (int i = 0; i < WIDTH; ++i) p[i] = a.v[i]; }
+    inline void store(int32_t* p, i32x8 a) { for (int i = 0; i < WIDTH; ++i) p[i] = a.v[i]; }
+
+    // Only the lanes in mask touch memory: the others load as 0 and are not
+    // stored, so p[i] outside mask may be out of bounds or another thread's
+    inline f32x8 load(const float* p, int mask) { f32x8 r; for (int i = 0; i < WIDTH; ++i) r.v[i] = mask >> i & 1 ? p[i] : 0.0f; return r; }
+    inline void store(float* p, f32x8 a, int mask) { for (int i = 0; i < WIDTH; ++i) if (mask >> i & 1) p[i] = a.v[i]; }
+
+#endif
+
+    // log2(a) for a > 0, to within 0.01: the exponent plus a quadratic in the
+    // mantissa m in [1, 2) that matches 1 + log2(m) at both ends
+    inline f32x8 log2(f32x8 a)
+    {
+        i32x8 bits = as_int(a);
+        f32x8 exponent = to_float((bits >> 23) + splat(-128));
+        f32x8 m = as_float((bits & splat(0x007fffff)) | splat(0x3f800000));
+        return exponent + (splat(-1.0f / 3) * m + splat(2.0f)) * m - splat(2.0f / 3);
+    }
+
+    // x^n for n >= 0, by repeated squaring
+    inline f32x8 pow(f32x8 x, int n)
+    {
+        f32x8 r = splat(1.0f);
+        for (; n > 0; n >>= 1, x = x * x)
+            if (n & 1)
+                r = r * x;
+        return r;
+    }
+
+    // Eight 3-vectors, one per lane
+    struct vec3x8
+    {
+        f32x8 x, y, z;
+    };
+
+    inline vec3x8 splat(float x, float y, float z) { return {splat(x), splat(y), splat(z)}; }
+
+    inline vec3x8 operator+(const vec3x8& a, const vec3x8& b) { return {a.x + b.x, a.y + b.y, a.z + b.z}; }
+    inline vec3x8 operator-(const vec3x8& a, const vec3x8& b) { return {a.x - b.x, a.y - b.y, a.z - b.z}; }
+    inline vec3x8 operator*(const vec3x8& a, f32x8 s) { return {a.x * s, a.y * s, a.z * s}; }
+    // component-wise
+    inline vec3x8 operator*(const vec3x8& a, const vec3x8& b) { return {a.x * b.x, a.y * b.y, a.z * b.z}; }
+
+    inline f32x8 dot(const vec3x8& a, const vec3x8& b) { return a.x * b.x + a.y * b.y + a.z * b.z; }
+    inline vec3x8 cross(const vec3x8& a, const vec3x8& b)
+    {
+        return {a.y * b.z - a.z * b.y, a.z * b.x - a.x * b.z, a.x * b.y - a.y * b.x};
+    }
+    inline f32x8 length(const vec3x8& a) { return sqrt(dot(a, a)); }
+    inline vec3x8 normalized(const vec3x8& a) { return a * (splat(1.0f) / length(a)); }
+}
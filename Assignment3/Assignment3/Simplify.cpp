@@ -0,0 +1,397 @@
+//
+// Quadric error mesh simplification, for levels of detail
+//
+
+#include "Simplify.hpp"
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <limits>
+#include <map>
+#include <queue>
+
+namespace
+{
+    // A candidate collapse of vertex from onto vertex to, valid while neither
+    // has changed since it was queued
+    struct collapse
+    {
+        double cost;
+        int from, to;
+        unsigned from_stamp, to_stamp;
+
+        bool operator>(const collapse& other) const { return cost > other.cost; }
+    };
+
+    class simplifier
+    {
+    public:
+        simplifier(const std::vector<Eigen::Vector3f>& positions, const std::vector<Eigen::Vector3i>& indices);
+
+        int live_triangles() const { return live; }
+        // Collapses edges, cheapest first, until at most target triangles are
+        // left; returns false if it ran out of edges it could collapse first
+        bool simplify(int target);
+        // How far the mesh's vertices are from what is left of the surface:
+        // for each, the distance to the triangles around the vertex it was
+        // collapsed into, the largest of them
+        float error() const;
+        // The triangles left, as indices into the mesh's vertices
+        std::vector<Eigen::Vector3i> triangles() const;
+
+    private:
+        // plane through the triangle, weighted by its area
+        static Eigen::Matrix4d plane_quadric(const Eigen::Vector3d& normal, const Eigen::Vector3d& point, double area);
+        double cost(int from, int to) const;
+        void queue_collapses(int v);
+        // the vertices sharing a live triangle with v
+        std::vector<int> neighbours(int v);
+        // Whether collapsing from onto to keeps the mesh manifold, its seams
+        // closed and its triangles facing the same way; fills wedge_map with
+        // the mesh vertex each of from's goes to
+        bool can_collapse(int from, int to, std::map<int, int>& wedge_map);
+        void do_collapse(int from, int to, const std::map<int, int>& wedge_map);
+
+        // triangles as indices into the mesh's vertices, wedges to the
+        // simplifier, and the vertex (distinct position) of each wedge
+        std::vector<std::array<int, 3>> tris;
+        std::vector<bool> tri_live;
+        std::vector<int> vertex_of;
+        int live = 0;
+
+        std::vector<Eigen::Vector3d> pos;
+        std::vector<Eigen::Matrix4d> quadric;
+        // area of the triangles gathered into each quadric; collapses are
+        // ordered by error per unit area, so large and small triangles compare
+        std::vector<double> area;
+        // triangles around each vertex; dead ones are dropped as they are met
+        std::vector<std::vector<int>> vertex_tris;
+        std::vector<bool> vertex_live;
+        std::vector<unsigned> stamp;
+        // the vertex each dead one was collapsed into
+        std::vector<int> collapsed_into;
+        std::priority_queue<collapse, std::vector<collapse>, std::greater<collapse>> queue;
+    };
+
+    double segment_distance(const Eigen::Vector3d& p, const Eigen::Vector3d& a, const Eigen::Vector3d& b)
+    {
+        Eigen::Vector3d ab = b - a;
+        double t = ab.squaredNorm() > 0 ? std::clamp((p - a).dot(ab) / ab.squaredNorm(), 0.0, 1.0) : 0.0;
+        return (a + t * ab - p).norm();
+    }
+
+    double triangle_distance(const Eigen::Vector3d& p, const Eigen::Vector3d& a, const Eigen::Vector3d& b,
+                             const Eigen::Vector3d& c)
+    {
+        // inside the prism over the triangle the plane is nearest, outside one of the edges
+        Eigen::Vector3d n = (b - a).cross(c - a);
+        if (n.squaredNorm() > 0 && (b - a).cross(p - a).dot(n) >= 0 && (c - b).cross(p - b).dot(n) >= 0 &&
+            (a - c).cross(p - c).dot(n) >= 0)
+            return std::abs((p - a).dot(n)) / n.norm();
+        return std::min({segment_distance(p, a, b), segment_distance(p, b, c), segment_distance(p, c, a)});
+    }
+
+    Eigen::Matrix4d simplifier::plane_quadric(const Eigen::Vector3d& normal, const Eigen::Vector3d& point, double area)
+    {
+        Eigen::Vector4d plane(normal.x(), normal.y(), normal.z(), -normal.dot(point));
+        return area * plane * plane.transpose();
+    }
+
+    simplifier::simplifier(const std::vector<Eigen::Vector3f>& positions, const std::vector<Eigen::Vector3i>& indices)
+    {
+        // vertices at the same position are one vertex here, whatever their attributes
+        std::map<std::array<float, 3>, int> vertex_index;
+        vertex_of.resize(positions.size());
+        for (size_t i = 0; i < positions.size(); ++i)
+        {
+            std::array<float, 3> key = {positions[i].x(), positions[i].y(), positions[i].z()};
+            auto it = vertex_index.emplace(key, (int)pos.size());
+            if (it.second)
+                pos.push_back(positions[i].cast<double>());
+            vertex_of[i] = it.first->second;
+        }
+
+        int num_vertices = (int)pos.size();
+        quadric.assign(num_vertices, Eigen::Matrix4d::Zero());
+        area.assign(num_vertices, 0.0);
+        vertex_tris.resize(num_vertices);
+        vertex_live.assign(num_vertices, true);
+        stamp.assign(num_vertices, 0);
+        collapsed_into.assign(num_vertices, -1);
+
+        // how many triangles share each edge, to find the open ones
+        std::map<std::pair<int, int>, int> edge_count;
+        for (auto& index : indices)
+        {
+            std::array<int, 3> v = {vertex_of[index[0]], vertex_of[index[1]], vertex_of[index[2]]};
+            if (v[0] == v[1] || v[1] == v[2] || v[2] == v[0])
+                continue;
+            int t = (int)tris.size();
+            tris.push_back({index[0], index[1], index[2]});
+            for (int k = 0; k < 3; ++k)
+            {
+                vertex_tris[v[k]].push_back(t);
+                ++edge_count[std::minmax(v[k], v[(k + 1) % 3])];
+            }
+
+            Eigen::Vector3d cross = (pos[v[1]] - pos[v[0]]).cross(pos[v[2]] - pos[v[0]]);
+            double tri_area = cross.norm() / 2;
+            if (tri_area == 0)
+                continue;
+            Eigen::Matrix4d q = plane_quadric(cross.normalized(), pos[v[0]], tri_area);
+            for (int k = 0; k < 3; ++k)
+            {
+                quadric[v[k]] += q;
+                area[v[k]] += tri_area;
+            }
+        }
+        tri_live.assign(tris.size(), true);
+        live = (int)tris.size();
+
+        // an open edge gets a heavily weighted plane through it, perpendicular to
+        // its triangle, so the boundary holds its shape
+        for (auto& tri : tris)
+            for (int k = 0; k < 3; ++k)
+            {
+                int a = vertex_of[tri[k]], b = vertex_of[tri[(k + 1) % 3]], c = vertex_of[tri[(k + 2) % 3]];
+                if (edge_count[std::minmax(a, b)] != 1)
+                    continue;
+                Eigen::Vector3d edge = pos[b] - pos[a];
+                Eigen::Vector3d normal = edge.cross(edge.cross(pos[c] - pos[a]));
+                if (normal.norm() == 0)
+                    continue;
+                Eigen::Matrix4d q = plane_quadric(normal.normalized(), pos[a], 100 * edge.squaredNorm());
+                quadric[a] += q;
+                quadric[b] += q;
+            }
+
+        for (int v = 0; v < num_vertices; ++v)
+            queue_collapses(v);
+    }
+
+    double simplifier::cost(int from, int to) const
+    {
+        Eigen::Vector4d p = pos[to].homogeneous();
+        double error = std::max(p.dot((quadric[from] + quadric[to]) * p), 0.0);
+        double gathered = area[from] + area[to];
+        return gathered > 0 ? error / gathered : error;
+    }
+
+    std::vector<int> simplifier::neighbours(int v)
+    {
+        std::vector<int> result;
+        auto& around = vertex_tris[v];
+        around.erase(std::remove_if(around.begin(), around.end(), [&](int t) { return !tri_live[t]; }),
+                     around.end());
+        for (int t : around)
+            for (int wedge : tris[t])
+                if (vertex_of[wedge] != v)
+                    result.push_back(vertex_of[wedge]);
+        std::sort(result.begin(), result.end());
+        result.erase(std::unique(result.begin(), result.end()), result.end());
+        return result;
+    }
+
+    void simplifier::queue_collapses(int v)
+    {
+        for (int n : neighbours(v))
+        {
+            queue.push({cost(v, n), v, n, stamp[v], stamp[n]});
+            queue.push({cost(n, v), n, v, stamp[n], stamp[v]});
+        }
+    }
+
+    bool simplifier::can_collapse(int from, int to, std::map<int, int>& wedge_map)
+    {
+        // Every wedge of from must go to the wedge of to it shares an edge with,
+        // and to just one: a wedge with none would drag its attributes across
+        // the mesh, which is how a collapse off a seam would tear it open
+        int shared = 0;
+        for (int t : vertex_tris[from])
+        {
+            if (!tri_live[t])
+                continue;
+            const auto& tri = tris[t];
+            int k_from = 0, k_to = -1;
+            for (int k = 0; k < 3; ++k)
+            {
+                if (vertex_of[tri[k]] == from)
+                    k_from = k;
+                if (vertex_of[tri[k]] == to)
+                    k_to = k;
+            }
+            if (k_to < 0)
+                continue;
+            ++shared;
+            auto it = wedge_map.emplace(tri[k_from], tri[k_to]);
+            if (it.first->second != tri[k_to])
+                return false;
+        }
+
+        // link condition: the ends may only have the vertices opposite the edge
+        // in common, or the collapse pinches the surface
+        std::vector<int> from_ring = neighbours(from), to_ring = neighbours(to);
+        std::vector<int> common;
+        std::set_intersection(from_ring.begin(), from_ring.end(), to_ring.begin(), to_ring.end(),
+                              std::back_inserter(common));
+        if ((int)common.size() != shared)
+            return false;
+
+        for (int t : vertex_tris[from])
+        {
+            const auto& tri = tris[t];
+            std::array<int, 3> v = {vertex_of[tri[0]], vertex_of[tri[1]], vertex_of[tri[2]]};
+            if (v[0] == to || v[1] == to || v[2] == to)
+                continue;
+            for (int k = 0; k < 3; ++k)
+                if (v[k] == from && !wedge_map.count(tri[k]))
+                    return false;
+
+            // a triangle that would turn by more than about 80 degrees, or collapse
+            // to a sliver, is taken as flipped
+            std::array<Eigen::Vector3d, 3> p = {pos[v[0]], pos[v[1]], pos[v[2]]};
+            Eigen::Vector3d before = (p[1] - p[0]).cross(p[2] - p[0]);
+            for (int k = 0; k < 3; ++k)
+                if (v[k] == from)
+                    p[k] = pos[to];
+            Eigen::Vector3d after = (p[1] - p[0]).cross(p[2] - p[0]);
+            if (after.dot(before) <= 0.2 * after.norm() * before.norm())
+                return false;
+        }
+        return true;
+    }
+
+    void simplifier::do_collapse(int from, int to, const std::map<int, int>& wedge_map)
+    {
+        for (int t : vertex_tris[from])
+        {
+            if (!tri_live[t])
+                continue;
+            auto& tri = tris[t];
+            bool has_to = false;
+            for (int wedge : tri)
+                has_to |= vertex_of[wedge] == to;
+            if (has_to)
+            {
+                tri_live[t] = false;
+                --live;
+                continue;
+            }
+            for (int& wedge : tri)
+                if (vertex_of[wedge] == from)
+                    wedge = wedge_map.at(wedge);
+            vertex_tris[to].push_back(t);
+        }
+        vertex_tris[from].clear();
+        vertex_live[from] = false;
+        collapsed_into[from] = to;
+        quadric[to] += quadric[from];
+        area[to] += area[from];
+        ++stamp[to];
+        queue_collapses(to);
+    }
+
+    bool simplifier::simplify(int target)
+    {
+        while (live > target)
+        {
+            if (queue.empty())
+                return false;
+            collapse c = queue.top();
+            queue.pop();
+            if (!vertex_live[c.from] || !vertex_live[c.to] || stamp[c.from] != c.from_stamp ||
+                stamp[c.to] != c.to_stamp)
+                continue;
+
+            std::map<int, int> wedge_map;
+            if (!can_collapse(c.from, c.to, wedge_map))
+                continue;
+            do_collapse(c.from, c.to, wedge_map);
+        }
+        return true;
+    }
+
+    float simplifier::error() const
+    {
+        double error = 0;
+        for (int v = 0; v < (int)pos.size(); ++v)
+        {
+            if (vertex_live[v])
+                continue;
+            int into = v;
+            while (!vertex_live[into])
+                into = collapsed_into[into];
+            double nearest = std::numeric_limits<double>::infinity();
+            for (int t : vertex_tris[into])
+                if (tri_live[t])
+                    nearest = std::min(nearest, triangle_distance(pos[v], pos[vertex_of[tris[t][0]]],
+                                                                  pos[vertex_of[tris[t][1]]],
+                                                                  pos[vertex_of[tris[t][2]]]));
+            if (nearest < std::numeric_limits<double>::infinity())
+                error = std::max(error, nearest);
+        }
+        return (float)error;
+    }
+
+    std::vector<Eigen::Vector3i> simplifier::triangles() const
+    {
+        std::vector<Eigen::Vector3i> result;
+        result.reserve(live);
+        for (size_t t = 0; t < tris.size(); ++t)
+            if (tri_live[t])
+                result.emplace_back(tris[t][0], tris[t][1], tris[t][2]);
+        return result;
+    }
+}
+
+std::vector<mesh_lod> build_lod_chain(const std::vector<Eigen::Vector3f>& positions,
+                                      const std::vector<Eigen::Vector3f>& normals,
+                                      const std::vector<Eigen::Vector2f>& tex_coords,
+                                      const std::vector<Eigen::Vector3i>& indices,
+                                      float ratio, int min_triangles)
+{
+    std::vector<mesh_lod> chain(1);
+    chain[0].positions = positions;
+    chain[0].normals = normals;
+    chain[0].tex_coords = tex_coords;
+    chain[0].indices = indices;
+
+    simplifier s(positions, indices);
+    while (true)
+    {
+        int previous = (int)chain.back().indices.size();
+        int target = (int)(previous * ratio);
+        if (target < min_triangles)
+            break;
+        bool reached = s.simplify(target);
+        // a level that saves little is not worth keeping, and the next would save less
+        if (!reached && s.live_triangles() > (previous + target) / 2)
+            break;
+
+        // keep only the vertices the level uses, renumbered in order of first use
+        mesh_lod level;
+        level.error = std::max(s.error(), chain.back().error);
+        std::vector<int> remap(positions.size(), -1);
+        for (auto& triangle : s.triangles())
+        {
+            Eigen::Vector3i index;
+            for (int k = 0; k < 3; ++k)
+            {
+                int& to = remap[triangle[k]];
+                if (to < 0)
+                {
+                    to = (int)level.positions.size();
+                    level.positions.push_back(positions[triangle[k]]);
+                    level.normals.push_back(normals[triangle[k]]);
+                    level.tex_coords.push_back(tex_coords[triangle[k]]);
+                }
+                index[k] = to;
+            }
+            level.indices.push_back(index);
+        }
+        chain.push_back(std::move(level));
+        if (!reached)
+            break;
+    }
+    return chain;
+}
@@ -0,0 +1,43 @@
+//
+// Quadric error mesh simplification, for levels of detail
+//
+
+#ifndef RASTERIZER_SIMPLIFY_H
+#define RASTERIZER_SIMPLIFY_H
+#include <Eigen/Dense>
+#include <vector>
+
+// One level of detail of an indexed mesh, with the vertex attributes of
+// rst::rasterizer::load_vertices
+struct mesh_lod
+{
+    std::vector<Eigen::Vector3f> positions, normals;
+    std::vector<Eigen::Vector2f> tex_coords;
+    std::vector<Eigen::Vector3i> indices;
+    // how far, in model space, the surface of the level is from that of the
+    // full mesh, measured from the full mesh's vertices
+    float error = 0;
+};
+
+// Builds a chain of levels of detail of the mesh, finest first: level 0 is
+// the mesh itself, and every later level keeps about ratio of the triangles
+// of the one before. The chain ends before a level of fewer than
+// min_triangles, or when simplifying stops getting anywhere.
+//
+// The levels come from one run of edge collapses in order of quadric error
+// (Garland and Heckbert): each vertex gathers the planes of the triangles
+// around it, and collapsing an edge moves one end onto the other, at the
+// cost of the squared distance from there to the planes of both. Vertices
+// only ever move onto other vertices of the mesh, so every vertex of a level
+// is one of the mesh's, attributes and all. Vertices at the same position
+// are one vertex to the simplifier; where they differ in attributes (a UV
+// seam) an edge may only collapse along the seam, so the seam stays closed.
+// Collapses that would flip a triangle or make the mesh non-manifold are
+// skipped.
+std::vector<mesh_lod> build_lod_chain(const std::vector<Eigen::Vector3f>& positions,
+                                      const std::vector<Eigen::Vector3f>& normals,
+                                      const std::vector<Eigen::Vector2f>& tex_coords,
+                                      const std::vector<Eigen::Vector3i>& indices,
+                                      float ratio = 0.25f, int min_triangles = 256);
+
+#endif //RASTERIZER_SIMPLIFY_H
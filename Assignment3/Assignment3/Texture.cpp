@@ -2,3 +2,380 @@
 // Created by LEI XU on 4/27/19.
 //
 
+#include "Texture.hpp"
+
+Texture::Texture(const std::string& name, Format format)
+    : format(format), report{}, height_step(1), gradient_step(1), height_report{}
+{
+    cv::Mat image_data = cv::imread(name);
+    cv::cvtColor(image_data, image_data, cv::COLOR_RGB2BGR);
+    width = image_data.cols;
+    height = image_data.rows;
+
+    // Each level is box filtered from the float texels of the one before,
+    // so rounding to 8 bits does not accumulate down the chain
+    std::vector<Eigen::Vector3f> colors(width * height);
+    for (int y = 0; y < height; ++y)
+        for (int x = 0; x < width; ++x)
+        {
+            auto color = image_data.at<cv::Vec3b>(y, x);
+            colors[y * width + x] = Eigen::Vector3f(color[0], color[1], color[2]);
+        }
+
+    int w = width, h = height;
+    while (true)
+    {
+        int tiles_x = (w + 7) / 8, tiles = tiles_x * ((h + 7) / 8);
+        report.uncompressed_bytes += tiles * 64 * sizeof(uint32_t);
+        if (format == Format::RGB8)
+        {
+            mip_level level{w, h, tiles_x, (int32_t)texels.size()};
+            texels.resize(texels.size() + tiles * 64, 0);
+            for (int y = 0; y < h; ++y)
+                for (int x = 0; x < w; ++x)
+                {
+                    Eigen::Vector3f c = colors[y * w + x];
+                    texels[texel_index(level, x, y)] = (uint32_t)std::lround(c.x()) |
+                                                       (uint32_t)std::lround(c.y()) << 8 |
+                                                       (uint32_t)std::lround(c.z()) << 16;
+                }
+            levels.push_back(level);
+        }
+        else
+        {
+            mip_level level{w, h, tiles_x, (int32_t)blocks.size()};
+            blocks.resize(blocks.size() + tiles * 4, 0);
+            for (int by = 0; by < h; by += 4)
+                for (int bx = 0; bx < w; bx += 4)
+                {
+                    // blocks past the edge of the level repeat its last row or column
+                    Eigen::Vector3f block[16];
+                    for (int t = 0; t < 16; ++t)
+                        block[t] = colors[std::min(by + t / 4, h - 1) * w + std::min(bx + t % 4, w - 1)];
+                    blocks[block_index(level, bx, by)] = format == Format::BC1 ? encode_bc1(block) : encode_bc4(block);
+                }
+            levels.push_back(level);
+
+            if (levels.size() == 1)
+            {
+                double squared_error = 0;
+                for (int y = 0; y < h; ++y)
+                    for (int x = 0; x < w; ++x)
+                    {
+                        Eigen::Vector3f error = fetch(level, x, y) - colors[y * w + x];
+                        squared_error += error.squaredNorm();
+                        report.max_error = std::max(report.max_error, error.cwiseAbs().maxCoeff());
+                    }
+                report.rmse = (float)std::sqrt(squared_error / (3.0 * w * h));
+                report.psnr = 20 * std::log10(255 / report.rmse);
+            }
+        }
+
+        if (w == 1 && h == 1)
+            break;
+
+        // odd sizes drop their last row or column, like OpenGL's mip chain
+        int next_w = std::max(w / 2, 1), next_h = std::max(h / 2, 1);
+        std::vector<Eigen::Vector3f> next(next_w * next_h);
+        for (int y = 0; y < next_h; ++y)
+            for (int x = 0; x < next_w; ++x)
+            {
+                int x0 = std::min(2 * x, w - 1), x1 = std::min(2 * x + 1, w - 1);
+                int y0 = std::min(2 * y, h - 1), y1 = std::min(2 * y + 1, h - 1);
+                next[y * next_w + x] = (colors[y0 * w + x0] + colors[y0 * w + x1] +
+                                        colors[y1 * w + x0] + colors[y1 * w + x1]) / 4;
+            }
+        colors = std::move(next);
+        w = next_w;
+        h = next_h;
+    }
+    report.bytes = texels.size() * sizeof(uint32_t) + blocks.size() * sizeof(uint64_t);
+}
+
+// The endpoints are the extremes of the colors along their principal axis,
+// then refined once by least squares for the indices they were given. Only
+// the four-color mode (first endpoint greater) is used.
+uint64_t Texture::encode_bc1(const Eigen::Vector3f* colors)
+{
+    auto pack565 = [](const Eigen::Vector3f& c) {
+        auto quantize = [](float v, int max) { return (uint32_t)std::lround(std::clamp(v, 0.0f, 255.0f) * max / 255); };
+        return quantize(c.x(), 31) << 11 | quantize(c.y(), 63) << 5 | quantize(c.z(), 31);
+    };
+    // quantizes the endpoints and picks the nearest color for every texel;
+    // returns the squared error
+    auto encode = [&](const Eigen::Vector3f& e0, const Eigen::Vector3f& e1, uint64_t& block) {
+        uint32_t c0 = pack565(e0), c1 = pack565(e1);
+        if (c0 < c1)
+            std::swap(c0, c1);
+        Eigen::Vector3f palette[4];
+        for (int i = 0; i < 4; ++i)
+            palette[i] = unpack565(c0) + (unpack565(c1) - unpack565(c0)) * BC1_WEIGHT[i];
+        block = c0 | (uint64_t)c1 << 16;
+        float error = 0;
+        for (int t = 0; t < 16; ++t)
+        {
+            int best = 0;
+            float best_error = (palette[0] - colors[t]).squaredNorm();
+            for (int i = 1; i < 4 && c0 != c1; ++i)
+            {
+                float e = (palette[i] - colors[t]).squaredNorm();
+                if (e < best_error)
+                {
+                    best = i;
+                    best_error = e;
+                }
+            }
+            block |= (uint64_t)best << (32 + 2 * t);
+            error += best_error;
+        }
+        return error;
+    };
+
+    Eigen::Vector3f mean = Eigen::Vector3f::Zero();
+    for (int t = 0; t < 16; ++t)
+        mean += colors[t];
+    mean /= 16;
+    Eigen::Matrix3f covariance = Eigen::Matrix3f::Zero();
+    for (int t = 0; t < 16; ++t)
+        covariance += (colors[t] - mean) * (colors[t] - mean).transpose();
+    // power iteration
+    Eigen::Vector3f axis = Eigen::Vector3f(1, 1, 1).normalized();
+    for (int i = 0; i < 8; ++i)
+    {
+        Eigen::Vector3f next = covariance * axis;
+        if (next.squaredNorm() < 1e-12f)
+            break;
+        axis = next.normalized();
+    }
+    float lo = 0, hi = 0;
+    for (int t = 0; t < 16; ++t)
+    {
+        float p = (colors[t] - mean).dot(axis);
+        lo = std::min(lo, p);
+        hi = std::max(hi, p);
+    }
+
+    uint64_t block;
+    float error = encode(mean + axis * hi, mean + axis * lo, block);
+
+    // with each texel's weight of the second endpoint fixed, the endpoints
+    // minimizing the squared error solve a 2x2 linear system
+    float a00 = 0, a01 = 0, a11 = 0;
+    Eigen::Vector3f b0 = Eigen::Vector3f::Zero(), b1 = Eigen::Vector3f::Zero();
+    for (int t = 0; t < 16; ++t)
+    {
+        float w = BC1_WEIGHT[block >> (32 + 2 * t) & 3];
+        a00 += (1 - w) * (1 - w);
+        a01 += (1 - w) * w;
+        a11 += w * w;
+        b0 += colors[t] * (1 - w);
+        b1 += colors[t] * w;
+    }
+    float det = a00 * a11 - a01 * a01;
+    if (det > 1e-6f)
+    {
+        uint64_t refined;
+        float refined_error = encode((b0 * a11 - b1 * a01) / det, (b1 * a00 - b0 * a01) / det, refined);
+        if (refined_error < error)
+            block = refined;
+    }
+    return block;
+}
+
+// The endpoints are the extremes of the red channel. Only the eight-value
+// mode (first endpoint greater) is used, or a block of one value.
+uint64_t Texture::encode_bc4(const Eigen::Vector3f* colors)
+{
+    float lo = 255, hi = 0;
+    for (int t = 0; t < 16; ++t)
+    {
+        lo = std::min(lo, colors[t].x());
+        hi = std::max(hi, colors[t].x());
+    }
+    uint32_t r0 = (uint32_t)std::lround(hi), r1 = (uint32_t)std::lround(lo);
+    uint64_t block = r0 | r1 << 8;
+    if (r0 == r1)
+        return block;
+    for (int t = 0; t < 16; ++t)
+    {
+        int best = 0;
+        float best_error = 256;
+        for (int i = 0; i < 8; ++i)
+        {
+            float e = std::abs(r0 + ((float)r1 - r0) * BC4_WEIGHT[i] - colors[t].x());
+            if (e < best_error)
+            {
+                best = i;
+                best_error = e;
+            }
+        }
+        block |= (uint64_t)best << (16 + 3 * t);
+    }
+    return block;
+}
+
+// Lane by lane the same as texel_index(const mip_level&, int, int)
+static simd::i32x8 tiled_index(simd::i32x8 offset, simd::i32x8 tiles_x, simd::i32x8 x, simd::i32x8 y)
+{
+    auto spread = [](simd::i32x8 a) {
+        return (a & simd::splat(1)) | (a & simd::splat(2)) << 1 | (a & simd::splat(4)) << 2;
+    };
+    simd::i32x8 seven = simd::splat(7);
+    simd::i32x8 tile = (y >> 3) * tiles_x + (x >> 3);
+    return offset + (tile << 6 | spread(y & seven) << 1 | spread(x & seven));
+}
+
+// Lane by lane the same as fetch(const mip_level&, int, int), for the level
+// at offset with tiles_x tiles per row
+simd::vec3x8 Texture::fetch(simd::i32x8 offset, simd::i32x8 tiles_x, simd::i32x8 x, simd::i32x8 y) const
+{
+    if (format == Format::RGB8)
+    {
+        simd::i32x8 index = tiled_index(offset, tiles_x, x, y);
+        simd::i32x8 texel = simd::gather(reinterpret_cast<const int32_t*>(texels.data()), index);
+        simd::i32x8 mask = simd::splat(0xff);
+        return simd::vec3x8{simd::to_float(texel & mask), simd::to_float(texel >> 8 & mask),
+                            simd::to_float(texel >> 16 & mask)};
+    }
+
+    // a block is gathered as its low and high 32 bits (blocks are little-endian)
+    simd::i32x8 tile = (y >> 3) * tiles_x + (x >> 3);
+    simd::i32x8 block = offset + (tile << 2 | (y >> 1 & simd::splat(2)) | (x >> 2 & simd::splat(1)));
+    const int32_t* halves = reinterpret_cast<const int32_t*>(blocks.data());
+    simd::i32x8 lo = simd::gather(halves, block << 1);
+    simd::i32x8 hi = simd::gather(halves, (block << 1) + simd::splat(1));
+    simd::i32x8 t = (y & simd::splat(3)) << 2 | (x & simd::splat(3));
+
+    if (format == Format::BC1)
+    {
+        auto unpack565 = [](simd::i32x8 c) {
+            return simd::vec3x8{simd::to_float(c >> 11 & simd::splat(31)) * simd::splat(255.0f / 31),
+                                simd::to_float(c >> 5 & simd::splat(63)) * simd::splat(255.0f / 63),
+                                simd::to_float(c & simd::splat(31)) * simd::splat(255.0f / 31)};
+        };
+        simd::vec3x8 c0 = unpack565(lo & simd::splat(0xffff)), c1 = unpack565(lo >> 16);
+        simd::f32x8 w = simd::gather(BC1_WEIGHT, hi >> (t << 1) & simd::splat(3));
+        return c0 + (c1 - c0) * w;
+    }
+
+    // the index of texel t starts at bit 16 + 3t of the 64, and may straddle the halves
+    simd::i32x8 bit = (t << 1) + t + simd::splat(16);
+    simd::i32x8 index = ((lo >> bit) | (hi >> (bit - simd::splat(32))) | (hi << (simd::splat(32) - bit))) & simd::splat(7);
+    simd::f32x8 r0 = simd::to_float(lo & simd::splat(0xff)), r1 = simd::to_float(lo >> 8 & simd::splat(0xff));
+    simd::f32x8 r = r0 + (r1 - r0) * simd::gather(BC4_WEIGHT, index);
+    return {r, r, r};
+}
+
+// Lane by lane the same as the scalar bilinear, each lane with its own size
+template <typename Fetch>
+simd::vec3x8 Texture::bilinear(simd::i32x8 w, simd::i32x8 h, simd::f32x8 u, simd::f32x8 v, Fetch fetch)
+{
+    simd::f32x8 fw = simd::to_float(w), fh = simd::to_float(h);
+    simd::f32x8 x = simd::max(simd::min(u * fw - simd::splat(0.5f), fw), simd::splat(-1.0f));
+    simd::f32x8 y = simd::max(simd::min((simd::splat(1.0f) - v) * fh - simd::splat(0.5f), fh), simd::splat(-1.0f));
+    simd::f32x8 x_floor = simd::floor(x), y_floor = simd::floor(y);
+    simd::f32x8 fx = x - x_floor, fy = y - y_floor;
+
+    simd::i32x8 zero = simd::splat(0), one = simd::splat(1);
+    simd::i32x8 x_last = w - one, y_last = h - one;
+    simd::i32x8 xi = simd::truncate(x_floor), yi = simd::truncate(y_floor);
+    simd::i32x8 x0 = simd::max(simd::min(xi, x_last), zero), x1 = simd::max(simd::min(xi + one, x_last), zero);
+    simd::i32x8 y0 = simd::max(simd::min(yi, y_last), zero), y1 = simd::max(simd::min(yi + one, y_last), zero);
+
+    simd::f32x8 gx = simd::splat(1.0f) - fx, gy = simd::splat(1.0f) - fy;
+    simd::vec3x8 top = fetch(x0, y0) * gx + fetch(x1, y0) * fx;
+    simd::vec3x8 bottom = fetch(x0, y1) * gx + fetch(x1, y1) * fx;
+    return top * gy + bottom * fy;
+}
+
+// The level's fields are gathered per lane
+simd::vec3x8 Texture::bilinear(simd::i32x8 level, simd::f32x8 u, simd::f32x8 v) const
+{
+    static_assert(sizeof(mip_level) == 4 * sizeof(int32_t), "mip_level is gathered as four int32s");
+    const int32_t* fields = reinterpret_cast<const int32_t*>(levels.data());
+    simd::i32x8 field = level << 2;
+    simd::i32x8 tiles_x = simd::gather(fields + 2, field);
+    simd::i32x8 offset = simd::gather(fields + 3, field);
+    return bilinear(simd::gather(fields, field), simd::gather(fields + 1, field), u, v,
+                    [&](simd::i32x8 x, simd::i32x8 y) { return fetch(offset, tiles_x, x, y); });
+}
+
+simd::vec3x8 Texture::getColorTrilinear(simd::f32x8 u, simd::f32x8 v, simd::f32x8 du_dx, simd::f32x8 dv_dx,
+                                        simd::f32x8 du_dy, simd::f32x8 dv_dy) const
+{
+    simd::f32x8 w = simd::splat((float)width), h = simd::splat((float)height);
+    simd::f32x8 ax = du_dx * w, ay = dv_dx * h, bx = du_dy * w, by = dv_dy * h;
+    simd::f32x8 footprint = simd::max(ax * ax + ay * ay, bx * bx + by * by);
+    // NaN ends up as the last level
+    simd::f32x8 lod = simd::splat(0.5f) * simd::log2(footprint);
+    lod = simd::max(simd::min(lod, simd::splat((float)levels.size() - 1)), simd::splat(0.0f));
+
+    simd::f32x8 lod_floor = simd::floor(lod);
+    simd::f32x8 t = lod - lod_floor;
+    simd::i32x8 level = simd::truncate(lod_floor);
+    simd::i32x8 next = simd::min(level + simd::splat(1), simd::splat((int32_t)levels.size() - 1));
+    simd::vec3x8 color = bilinear(level, u, v);
+    return color + (bilinear(next, u, v) - color) * t;
+}
+
+void Texture::buildHeightMap(float gradient_scale)
+{
+    const mip_level& level = levels[0];
+    std::vector<float> heights(width * height);
+    for (int y = 0; y < height; ++y)
+        for (int x = 0; x < width; ++x)
+            heights[y * width + x] = fetch(level, x, y).norm();
+
+    // +v is up the image, towards the row before
+    std::vector<Eigen::Vector3f> values(width * height);
+    float max_height = 0, max_gradient = 0;
+    for (int y = 0; y < height; ++y)
+        for (int x = 0; x < width; ++x)
+        {
+            float h = heights[y * width + x];
+            Eigen::Vector3f& value = values[y * width + x];
+            value[0] = h;
+            value[1] = gradient_scale * (heights[y * width + std::min(x + 1, width - 1)] - h);
+            value[2] = gradient_scale * (heights[std::max(y - 1, 0) * width + x] - h);
+            max_height = std::max(max_height, h);
+            max_gradient = std::max({max_gradient, std::abs(value[1]), std::abs(value[2])});
+        }
+
+    // the full int16 range for each, and a step of 1 when all are 0
+    height_step = max_height > 0 ? max_height / INT16_MAX : 1.0f;
+    gradient_step = max_gradient > 0 ? max_gradient / INT16_MAX : 1.0f;
+    Eigen::Vector3f step(height_step, gradient_step, gradient_step);
+
+    size_t texels_count = (size_t)level.tiles_x * ((height + 7) / 8) * 64;
+    height_map.assign(texels_count * 3 + 1, 0);
+    double squared_error = 0;
+    height_report = {};
+    for (int y = 0; y < height; ++y)
+        for (int x = 0; x < width; ++x)
+        {
+            const Eigen::Vector3f& value = values[y * width + x];
+            int16_t* texel = &height_map[texel_index(level, x, y) * 3];
+            for (int c = 0; c < 3; ++c)
+            {
+                texel[c] = (int16_t)std::lround(value[c] / step[c]);
+                float error = std::abs(texel[c] * step[c] - value[c]);
+                squared_error += error * error;
+                height_report.max_error = std::max(height_report.max_error, error);
+            }
+        }
+    height_report.bytes = height_map.size() * sizeof(int16_t);
+    height_report.uncompressed_bytes = texels_count * 3 * sizeof(float);
+    height_report.rmse = (float)std::sqrt(squared_error / (3.0 * width * height));
+    height_report.psnr = 20 * std::log10(std::max(max_height, max_gradient) / height_report.rmse);
+}
+
+simd::vec3x8 Texture::getHeightGradient(simd::f32x8 u, simd::f32x8 v) const
+{
+    simd::i32x8 tiles_x = simd::splat(levels[0].tiles_x);
+    return bilinear(simd::splat(width), simd::splat(height), u, v, [&](simd::i32x8 x, simd::i32x8 y) {
+        simd::i32x8 index = tiled_index(simd::splat(0), tiles_x, x, y) * simd::splat(3);
+        return simd::vec3x8{simd::to_float(simd::gather(height_map.data(), index)) * simd::splat(height_step),
+                            simd::to_float(simd::gather(height_map.data() + 1, index)) * simd::splat(gradient_step),
+                            simd::to_float(simd::gather(height_map.data() + 2, index)) * simd::splat(gradient_step)};
+    });
+}
@@ -5,30 +5,221 @@
 #ifndef RASTERIZER_TEXTURE_H
 #define RASTERIZER_TEXTURE_H
 #include "global.hpp"
+#include "Simd.hpp"
 #include <Eigen/Dense>
 #include <opencv2/opencv.hpp>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+// The image is kept as a mip chain built at load time, each level half the
+// size of the one before, down to 1x1. Every level is stored in 8x8 texel
+// tiles with the texels of a tile in Morton (Z) order, so a bilinear
+// footprint and the texels of neighbouring pixels mostly share cache lines.
+// Colors come back in [0, 255], and coordinates outside [0, 1] are clamped
+// to the edge of the image.
 class Texture{
+public:
+    // How the texels are stored:
+    //  - RGB8: packed 8-bit RGB, 4 bytes per texel
+    //  - BC1: 4x4 blocks of two RGB565 endpoints and a 2-bit index per texel
+    //    choosing one of four colors on the line between them, 8 bytes per block
+    //  - BC4: 4x4 blocks of one channel, two 8-bit endpoints and a 3-bit index
+    //    per texel into eight values between them, 8 bytes per block. Meant
+    //    for grey images such as height maps: only red is kept, and it comes
+    //    back in all three channels.
+    // The block formats are encoded once at load time and decoded texel by
+    // texel as the samplers fetch them.
+    enum class Format
+    {
+        RGB8,
+        BC1,
+        BC4
+    };
+
+    // Compression error of the full-resolution level against the image, over
+    // all three channels in [0, 255]
+    struct CompressionReport
+    {
+        size_t bytes;               // of the whole mip chain
+        size_t uncompressed_bytes;  // of the same chain in RGB8
+        float rmse, psnr, max_error;
+    };
+
 private:
-    cv::Mat image_data;
+    // Four int32s, so the packet sampler can gather them per lane
+    struct mip_level
+    {
+        int32_t width, height;
+        int32_t tiles_x;
+        // of the level's first texel in texels, or first block in blocks
+        int32_t offset;
+    };
+    Format format;
+    std::vector<mip_level> levels;
+    std::vector<uint32_t> texels;
+    // two per tile in x and in y, also in Morton order
+    std::vector<uint64_t> blocks;
+    CompressionReport report;
+    // buildHeightMap only: height, dU and dV per texel of the full-resolution
+    // image, tiled like its texels, as int16 steps of height_step and
+    // gradient_step. One int16 more at the end, as the packet sampler reads
+    // 32 bits at each 16-bit value.
+    std::vector<int16_t> height_map;
+    float height_step, gradient_step;
+    CompressionReport height_report;
 
-public:
-    Texture(const std::string& name)
+    // the tile first, then (x, y) inside it with the bits interleaved
+    static int spread(int a) { return (a & 1) | (a & 2) << 1 | (a & 4) << 2; }
+    static int texel_index(const mip_level& level, int x, int y)
+    {
+        return level.offset + (((y >> 3) * level.tiles_x + (x >> 3)) << 6 | spread(y & 7) << 1 | spread(x & 7));
+    }
+    static int block_index(const mip_level& level, int x, int y)
+    {
+        return level.offset + (((y >> 3) * level.tiles_x + (x >> 3)) << 2 | (y >> 1 & 2) | (x >> 2 & 1));
+    }
+
+    // Weight of the second endpoint for each index of a block
+    static constexpr float BC1_WEIGHT[4] = {0.0f, 1.0f, 1.0f / 3, 2.0f / 3};
+    static constexpr float BC4_WEIGHT[8] = {0.0f, 1.0f, 1.0f / 7, 2.0f / 7, 3.0f / 7, 4.0f / 7, 5.0f / 7, 6.0f / 7};
+
+    static Eigen::Vector3f unpack(uint32_t texel)
+    {
+        return Eigen::Vector3f(texel & 0xff, texel >> 8 & 0xff, texel >> 16 & 0xff);
+    }
+    static Eigen::Vector3f unpack565(uint32_t c)
+    {
+        return Eigen::Vector3f((c >> 11 & 31) * (255.0f / 31), (c >> 5 & 63) * (255.0f / 63), (c & 31) * (255.0f / 31));
+    }
+
+    Eigen::Vector3f fetch(const mip_level& level, int x, int y) const
+    {
+        if (format == Format::RGB8)
+            return unpack(texels[texel_index(level, x, y)]);
+
+        // texels of a block are numbered row by row
+        uint64_t block = blocks[block_index(level, x, y)];
+        int t = (y & 3) * 4 + (x & 3);
+        if (format == Format::BC1)
+        {
+            Eigen::Vector3f c0 = unpack565(block & 0xffff), c1 = unpack565(block >> 16 & 0xffff);
+            return c0 + (c1 - c0) * BC1_WEIGHT[block >> (32 + 2 * t) & 3];
+        }
+        float r0 = block & 0xff, r1 = block >> 8 & 0xff;
+        float r = r0 + (r1 - r0) * BC4_WEIGHT[block >> (16 + 3 * t) & 7];
+        return Eigen::Vector3f(r, r, r);
+    }
+
+    // Bilinear filtering of the w x h texels returned by fetch(x, y)
+    template <typename Fetch>
+    static Eigen::Vector3f bilinear(int w, int h, float u, float v, Fetch fetch)
     {
-        image_data = cv::imread(name);
-        cv::cvtColor(image_data, image_data, cv::COLOR_RGB2BGR);
-        width = image_data.cols;
-        height = image_data.rows;
+        // texel centers sit at half-integer coordinates
+        float x = std::clamp(u * w - 0.5f, -1.0f, (float)w);
+        float y = std::clamp((1 - v) * h - 0.5f, -1.0f, (float)h);
+        float x_floor = std::floor(x), y_floor = std::floor(y);
+        float fx = x - x_floor, fy = y - y_floor;
+        int x0 = std::clamp((int)x_floor, 0, w - 1), x1 = std::clamp((int)x_floor + 1, 0, w - 1);
+        int y0 = std::clamp((int)y_floor, 0, h - 1), y1 = std::clamp((int)y_floor + 1, 0, h - 1);
+
+        Eigen::Vector3f top = fetch(x0, y0) * (1 - fx) + fetch(x1, y0) * fx;
+        Eigen::Vector3f bottom = fetch(x0, y1) * (1 - fx) + fetch(x1, y1) * fx;
+        return top * (1 - fy) + bottom * fy;
+    }
+
+    Eigen::Vector3f bilinear(const mip_level& level, float u, float v) const
+    {
+        return bilinear(level.width, level.height, u, v, [&](int x, int y) { return fetch(level, x, y); });
     }
 
+    // Encode the 16 texels of a block, row by row
+    static uint64_t encode_bc1(const Eigen::Vector3f* colors);
+    static uint64_t encode_bc4(const Eigen::Vector3f* colors);
+
+    simd::vec3x8 fetch(simd::i32x8 offset, simd::i32x8 tiles_x, simd::i32x8 x, simd::i32x8 y) const;
+    template <typename Fetch>
+    static simd::vec3x8 bilinear(simd::i32x8 w, simd::i32x8 h, simd::f32x8 u, simd::f32x8 v, Fetch fetch);
+    simd::vec3x8 bilinear(simd::i32x8 level, simd::f32x8 u, simd::f32x8 v) const;
+
+public:
+    Texture(const std::string& name, Format format = Format::RGB8);
+
     int width, height;
 
-    Eigen::Vector3f getColor(float u, float v)
+    int numLevels() const { return (int)levels.size(); }
+    // Only meaningful for the block formats
+    const CompressionReport& getCompressionReport() const { return report; }
+    // Of the height map against (height, dU, dV) as floats, 12 bytes per
+    // texel; PSNR is taken against the largest value of the three. Only
+    // meaningful after buildHeightMap.
+    const CompressionReport& getHeightMapReport() const { return height_report; }
+
+    // The nearest texel of the full-resolution image
+    Eigen::Vector3f getColor(float u, float v) const
+    {
+        int x = (int)std::clamp(u * width, 0.0f, width - 1.0f);
+        int y = (int)std::clamp((1 - v) * height, 0.0f, height - 1.0f);
+        return fetch(levels[0], x, y);
+    }
+
+    // Bilinear filtering within one mip level, 0 being the full image
+    Eigen::Vector3f getColorBilinear(float u, float v, int level = 0) const
+    {
+        return bilinear(levels[level], u, v);
+    }
+
+    // The mip level whose texels are about one pixel in size, given the
+    // screen-space derivatives of (u, v): log2 of the longer side of the
+    // pixel's footprint in full-resolution texels, clamped to the chain
+    float getLod(const Eigen::Vector2f& duv_dx, const Eigen::Vector2f& duv_dy) const
+    {
+        Eigen::Vector2f size(width, height);
+        float footprint = std::max(duv_dx.cwiseProduct(size).squaredNorm(), duv_dy.cwiseProduct(size).squaredNorm());
+        float lod = 0.5f * std::log2(footprint);
+        if (!(lod > 0))
+            return 0;
+        return std::min(lod, (float)levels.size() - 1);
+    }
+
+    // Trilinear filtering: bilinear in the two mip levels around getLod,
+    // blended by its fraction
+    Eigen::Vector3f getColorTrilinear(float u, float v, const Eigen::Vector2f& duv_dx,
+                                      const Eigen::Vector2f& duv_dy) const
+    {
+        float lod = getLod(duv_dx, duv_dy);
+        int level = (int)lod;
+        float t = lod - level;
+        Eigen::Vector3f color = bilinear(levels[level], u, v);
+        if (t > 0)
+            color = color * (1 - t) + bilinear(levels[level + 1], u, v) * t;
+        return color;
+    }
+
+    // The same for eight fragments at once, each with its own level; lanes
+    // holding NaN or infinity come back with some color of the texture
+    simd::vec3x8 getColorTrilinear(simd::f32x8 u, simd::f32x8 v, simd::f32x8 du_dx, simd::f32x8 dv_dx,
+                                   simd::f32x8 du_dy, simd::f32x8 dv_dy) const;
+
+    // Derives a height map from the full-resolution image for bump and
+    // displacement mapping. The height of a texel is the length of its color,
+    // and next to it are stored the differences dU and dV to the height of
+    // the next texel towards +u and towards +v (0 at the edge), times
+    // gradient_scale, so a shader needs one fetch instead of three. The three
+    // are quantized to int16, 6 bytes per texel.
+    void buildHeightMap(float gradient_scale);
+    bool hasHeightMap() const { return !height_map.empty(); }
+
+    // (height, dU, dV) of buildHeightMap at (u, v), bilinearly filtered
+    Eigen::Vector3f getHeightGradient(float u, float v) const
     {
-        auto u_img = u * width;
-        auto v_img = (1 - v) * height;
-        auto color = image_data.at<cv::Vec3b>(v_img, u_img);
-        return Eigen::Vector3f(color[0], color[1], color[2]);
+        return bilinear(width, height, u, v, [&](int x, int y) {
+            const int16_t* texel = &height_map[texel_index(levels[0], x, y) * 3];
+            return Eigen::Vector3f(texel[0] * height_step, texel[1] * gradient_step, texel[2] * gradient_step);
+        });
     }
+    simd::vec3x8 getHeightGradient(simd::f32x8 u, simd::f32x8 v) const;
 
 };
 #endif //RASTERIZER_TEXTURE_H
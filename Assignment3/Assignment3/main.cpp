@@ -1,6 +1,14 @@
 #define _USE_MATH_DEFINES  // include֮ǰ
 #include <cmath>
 #include <iostream>
+#include <fstream>
+#include <sstream>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
 #include<opencv2/opencv.hpp>
 #include <Eigen/Dense>
 #include "global.hpp"
@@ -8,6 +16,7 @@
 #include "Triangle.hpp"
 #include "Shader.hpp"
 #include "Texture.hpp"
+#include "Simplify.hpp"
 #include "OBJ_Loader.h"
 
 Eigen::Matrix4f get_view_matrix(Eigen::Vector3f eye_pos)
@@ -25,6 +34,23 @@ Eigen::Matrix4f get_view_matrix(Eigen::Vector3f eye_pos)
     return view;
 }
 
+// View matrix of a camera at eye looking at target, +y up unless it looks along y
+Eigen::Matrix4f get_look_at_matrix(const Eigen::Vector3f& eye, const Eigen::Vector3f& target)
+{
+    Eigen::Vector3f forward = (target - eye).normalized();
+    Eigen::Vector3f up = std::abs(forward.y()) > 0.99f ? Eigen::Vector3f(0, 0, 1) : Eigen::Vector3f(0, 1, 0);
+    Eigen::Vector3f right = forward.cross(up).normalized();
+    up = right.cross(forward);
+
+    Eigen::Matrix4f view = Eigen::Matrix4f::Identity();
+    view.block<1, 3>(0, 0) = right.transpose();
+    view.block<1, 3>(1, 0) = up.transpose();
+    view.block<1, 3>(2, 0) = -forward.transpose();
+    view.block<3, 1>(0, 3) = -view.block<3, 3>(0, 0) * eye;
+
+    return view;
+}
+
 Eigen::Matrix4f get_model_matrix(float angle)
 {
     Eigen::Matrix4f rotation;
@@ -97,6 +123,54 @@ struct light
     Eigen::Vector3f intensity;
 };
 
+// ӰͼķֱʣԼѯʱطѵľ루ԼڵԼ
+constexpr int SHADOW_MAP_SIZE = 1024;
+constexpr float SHADOW_NORMAL_OFFSET = 0.02f;
+
+// What a light sees of the mesh, for shadows: a depth-only pass renders the
+// mesh from the light, and a point is in shadow where that depth holds
+// something nearer to the light
+struct shadow_map
+{
+    rst::rasterizer depth{SHADOW_MAP_SIZE, SHADOW_MAP_SIZE};
+    // the mesh's levels of detail, loaded into depth
+    rst::lod_buf_id mesh;
+    // from the view space the shaders light in to the light's clip space
+    Eigen::Matrix4f light_clip;
+
+    // 1 if the view space point is lit, 0 in shadow
+    float visibility(const Eigen::Vector3f& point, const Eigen::Vector3f& normal) const
+    {
+        Eigen::Vector4f clip = light_clip * (point + normal * SHADOW_NORMAL_OFFSET).homogeneous();
+        Eigen::Vector4f screen = depth.to_screen(clip);
+        if (!(screen.x() >= 0 && screen.x() < SHADOW_MAP_SIZE && screen.y() >= 0 && screen.y() < SHADOW_MAP_SIZE))
+            return 1;
+        return screen.z() <= depth.get_depth((int)screen.x(), (int)screen.y()) ? 1.0f : 0.0f;
+    }
+};
+
+// Blinn-Phong ɫõĳ rst::rasterizer::set_uniforms ÿλ
+// һΣɫͨ payload.uniforms<lighting_uniforms>() ȡ
+struct lighting_uniforms
+{
+    Eigen::Vector3f ka;                   // ⷴϵ
+    Eigen::Vector3f ks;                   // 淴ϵ
+    light lights[2];
+    Eigen::Vector3f amb_light_intensity;  // ǿ
+    Eigen::Vector3f eye_pos;              // ۲λ
+    int p;                                // ߹ָȡpacket ɫ simd::pow ֻ
+    const shadow_map* shadows = nullptr;  // shadows[k] Ӧ lights[k]ӰʱΪ
+};
+
+// light  point Ŀɼȣ1 Ϊ0 ΪӰУӰʱΪ 1
+static float light_visibility(const lighting_uniforms& uniforms, const light& light, const Eigen::Vector3f& point,
+                              const Eigen::Vector3f& normal)
+{
+    if (!uniforms.shadows)
+        return 1;
+    return uniforms.shadows[&light - uniforms.lights].visibility(point, normal);
+}
+
 /**
  * Ƭɫ - Blinn-Phongģ͵Ⱦ
  * 
@@ -121,11 +195,11 @@ Eigen::Vector3f texture_fragment_shader(const fragment_shader_payload& payload)
     Eigen::Vector3f return_color = { 0, 0, 0 };
     if (payload.texture)
     {
-        // вɫֵ
+        // вɫֵԹˣmipmap㼶Ļռ䵼
         // [0,1]ΧڣֹԽ
         float u = std::clamp(static_cast<double>(payload.tex_coords(0)), 0.0, 1.0);
         float v = std::clamp(static_cast<double>(payload.tex_coords(1)), 0.0, 1.0);
-        return_color = payload.texture->getColor(u, v);
+        return_color = payload.texture->getColorTrilinear(u, v, payload.tex_dx, payload.tex_dy);
     }
     
     // õɫתΪʽ
@@ -133,19 +207,18 @@ Eigen::Vector3f texture_fragment_shader(const fragment_shader_payload& payload)
     texture_color << return_color.x(), return_color.y(), return_color.z();
 
     // === 2ʲ ===
-    Eigen::Vector3f ka = Eigen::Vector3f(0.005, 0.005, 0.005);  // ⷴϵ(Сֵ΢)
-    Eigen::Vector3f kd = texture_color / 255.f;                  // ϵ(ʹɫһ[0,1])
-    Eigen::Vector3f ks = Eigen::Vector3f(0.7937, 0.7937, 0.7937); // 淴ϵ(ϸֵԸ߹)
+    // ÿλʱ set_uniforms һΣ lighting_uniforms
+    const lighting_uniforms& uniforms = payload.uniforms<lighting_uniforms>();
+    const Eigen::Vector3f& ka = uniforms.ka;  // ⷴϵ(Сֵ΢)
+    Eigen::Vector3f kd = texture_color / 255.f;  // ϵ(ʹɫһ[0,1])
+    const Eigen::Vector3f& ks = uniforms.ks;  // 淴ϵ(ϸֵԸ߹)
 
     // === 3Դͳ ===
-    auto l1 = light{ {20, 20, 20}, {500, 500, 500} };   // Դ1λ(20,20,20)ǿ(500,500,500)
-    auto l2 = light{ {-20, 20, 0}, {500, 500, 500} };   // Դ2λ(-20,20,0)ǿ(500,500,500)
+    const auto& lights = uniforms.lights;  // Դбֶ֧Դ
+    const Eigen::Vector3f& amb_light_intensity = uniforms.amb_light_intensity;  // ǿ
+    const Eigen::Vector3f& eye_pos = uniforms.eye_pos;  // ۲λãλã
 
-    std::vector<light> lights = { l1, l2 };              // Դбֶ֧Դ
-    Eigen::Vector3f amb_light_intensity{ 10, 10, 10 };   // ǿ
-    Eigen::Vector3f eye_pos{ 0, 0, 10 };                 // ۲λãλã
-
-    float p = 150;  // ߹ָƸ߹̶ȣֵԽ߹ԽУ
+    float p = uniforms.p;  // ߹ָƸ߹̶ȣֵԽ߹ԽУ
 
     // === 4ȡҪϢ ===
     Eigen::Vector3f color = texture_color;  // ǰصĻɫ
@@ -170,6 +243,8 @@ Eigen::Vector3f texture_fragment_shader(const fragment_shader_payload& payload)
         // ǿ˥ƽȶɣ
         // ǿ = ԭʼǿ / ?
         Eigen::Vector3f attenuated_light = light.intensity / ((light.position - point).norm() * (light.position - point).norm());
+        // ӰеƬֻʣ
+        attenuated_light *= light_visibility(uniforms, light, point, normal);
         
         // === Blinn-Phongģ͵ ===
         
@@ -221,19 +296,18 @@ Eigen::Vector3f texture_fragment_shader(const fragment_shader_payload& payload)
 Eigen::Vector3f phong_fragment_shader(const fragment_shader_payload& payload)
 {
     // === 1ʲ ===
-    Eigen::Vector3f ka = Eigen::Vector3f(0.005, 0.005, 0.005);  // ⷴϵֵͻ⣩
-    Eigen::Vector3f kd = payload.color;                          // ϵʹöɫͨѹһ
-    Eigen::Vector3f ks = Eigen::Vector3f(0.7937, 0.7937, 0.7937); // 淴ϵֵ߹⣩
+    // ÿλʱ set_uniforms һΣ lighting_uniforms
+    const lighting_uniforms& uniforms = payload.uniforms<lighting_uniforms>();
+    const Eigen::Vector3f& ka = uniforms.ka;  // ⷴϵֵͻ⣩
+    Eigen::Vector3f kd = payload.color;  // ϵʹöɫͨѹһ
+    const Eigen::Vector3f& ks = uniforms.ks;  // 淴ϵֵ߹⣩
 
     // === 2Դ ===
-    auto l1 = light{{20, 20, 20}, {500, 500, 500}};   // ԴǰǿȰ׹
-    auto l2 = light{{-20, 20, 0}, {500, 500, 500}};   // ԴϷ
-
-    std::vector<light> lights = {l1, l2};              // ˫ԴãģӰ
-    Eigen::Vector3f amb_light_intensity{10, 10, 10};   // ǿȣṩ
-    Eigen::Vector3f eye_pos{0, 0, 10};                 // ۲/λ
+    const auto& lights = uniforms.lights;  // ˫ԴãģӰ
+    const Eigen::Vector3f& amb_light_intensity = uniforms.amb_light_intensity;  // ǿȣṩ
+    const Eigen::Vector3f& eye_pos = uniforms.eye_pos;  // ۲/λ
 
-    float p = 150;  // ߹ָƸ߹⼯жȣֵԽ߹Խ
+    float p = uniforms.p;  // ߹ָƸ߹⼯жȣֵԽ߹Խ
 
     // === 3غȡȾ ===
     Eigen::Vector3f color = payload.color;    // ƬεĻɫԶֵ
@@ -262,6 +336,8 @@ Eigen::Vector3f phong_fragment_shader(const fragment_shader_payload& payload)
         // ľƽ˥I = I? / r?
         // ԽԶǿ˥Խ죬ģʵմ
         Eigen::Vector3f attenuated_light = light.intensity / ((light.position - point).norm() * (light.position - point).norm());
+        // ӰеƬֻʣ
+        attenuated_light *= light_visibility(uniforms, light, point, normal);
         
         // --- 4.3Blinn-Phongģ͵ ---
         
@@ -291,7 +367,9 @@ Eigen::Vector3f phong_fragment_shader(const fragment_shader_payload& payload)
     return result_color * 255.f;
 }
 
-
+// ͹/λӳ kh: ߶ϵkn: λƺͷŶǿϵ
+// ߶ͼݶȣdU, dVڼʱѳ kh * kn Texture::buildHeightMap
+constexpr float kh = 0.2f, kn = 0.1f;
 
 /**
  * λӳƬɫ - ͨ߶ͼʵʵλƺͷŶ
@@ -315,28 +393,24 @@ Eigen::Vector3f phong_fragment_shader(const fragment_shader_payload& payload)
 Eigen::Vector3f displacement_fragment_shader(const fragment_shader_payload& payload)
 {
     // === ʲ ===
-    Eigen::Vector3f ka = Eigen::Vector3f(0.005, 0.005, 0.005);  // ⷴϵ
-    Eigen::Vector3f kd = payload.color;                          // ϵʹöɫ
-    Eigen::Vector3f ks = Eigen::Vector3f(0.7937, 0.7937, 0.7937); // 淴ϵ
+    // ÿλʱ set_uniforms һΣ lighting_uniforms
+    const lighting_uniforms& uniforms = payload.uniforms<lighting_uniforms>();
+    const Eigen::Vector3f& ka = uniforms.ka;  // ⷴϵ
+    Eigen::Vector3f kd = payload.color;  // ϵʹöɫ
+    const Eigen::Vector3f& ks = uniforms.ks;  // 淴ϵ
 
     // === Դ ===
-    auto l1 = light{{20, 20, 20}, {500, 500, 500}};   // Դǰǿ
-    auto l2 = light{{-20, 20, 0}, {500, 500, 500}};   // ԴϷ
+    const auto& lights = uniforms.lights;  // ˫Դϵͳ
+    const Eigen::Vector3f& amb_light_intensity = uniforms.amb_light_intensity;  // ǿ
+    const Eigen::Vector3f& eye_pos = uniforms.eye_pos;  // ۲/λ
 
-    std::vector<light> lights = {l1, l2};              // ˫Դϵͳ
-    Eigen::Vector3f amb_light_intensity{10, 10, 10};   // ǿ
-    Eigen::Vector3f eye_pos{0, 0, 10};                 // ۲/λ
-
-    float p = 150;  // ߹ָƾ淴̶ȣ
+    float p = uniforms.p;  // ߹ָƾ淴̶ȣ
 
     // === غȡϢ ===
     Eigen::Vector3f color = payload.color;    // Ƭλɫ
     Eigen::Vector3f point = payload.view_pos; // Ƭӿռеԭʼλ
     Eigen::Vector3f normal = payload.normal;  // Ƭεԭʼ淨
 
-    // === λӳ ===
-    float kh = 0.2, kn = 0.1;  // kh: ߶ϵkn: λƺͷŶǿϵ
-
     // === λӳ㷨ʵ ===
     
     // 1: ȡԭʼ߿ռ
@@ -346,7 +420,8 @@ Eigen::Vector3f displacement_fragment_shader(const fragment_shader_payload& payl
     // 2:  t
     // ʽt = (x*y/(x?+z?), (x?+z?), z*y/(x?+z?))
     // ȷ뷨γ߿ռϵĵһ
-    Eigen::Vector3f t(x * y / sqrt(x * x + z * z), sqrt(x * x + z * z), z * y / sqrt(x * x + z * z));
+    float xz = sqrt(x * x + z * z);
+    Eigen::Vector3f t(x * y / xz, xz, z * y / xz);
     
     // 3:  b = n  t
     // ͨȷͬʱֱڷ
@@ -360,16 +435,14 @@ Eigen::Vector3f displacement_fragment_shader(const fragment_shader_payload& payl
            t[2], b[2], z;    // Уz
 
     // 5: ȡϢͰȫ
-    float w = payload.texture->width, h = payload.texture->height;  // ֱ
     float u = std::clamp(static_cast<double>(payload.tex_coords(0)), 0.0, 1.0);  // UԼ
     float v = std::clamp(static_cast<double>(payload.tex_coords(1)), 0.0, 1.0);  // VԼ
 
-    // 6: ߶ͼݶϢ
+    // 6: Ԥĸ߶ͼȡ߶Ⱥݶȣһ˫Բ
     // dUUˮƽĸ߶ȱ仯ʣڼ߷ķ仯
-    float dU = kh * kn * (payload.texture->getColor(u + 1 / w, v).norm() - payload.texture->getColor(u, v).norm());
-    
     // dVV򣨴ֱĸ߶ȱ仯ʣڼ㸱߷ķ仯
-    float dV = kh * kn * (payload.texture->getColor(u, (v + 1) / h).norm() - payload.texture->getColor(u, v).norm());
+    Eigen::Vector3f height_gradient = payload.texture->getHeightGradient(u, v);
+    float dU = height_gradient.y(), dV = height_gradient.z();
     
     // 7: ߿ռеķŶ
     // ln = (-dU, -dV, 1)߿ռеŶ
@@ -380,7 +453,7 @@ Eigen::Vector3f displacement_fragment_shader(const fragment_shader_payload& payl
     // 8: ݸ߶ͼʵλƶλ
     // λ = ԭλ + λǿ *  * ǰλõĸ߶ֵ
     // λӳ밼͹ӳĺʵʸı伸״
-    point = point + kn * normal * payload.texture->getColor(u, v).norm();
+    point = point + kn * normal * height_gradient.x();
     
     // 9: ݶ¼淨
     // ߿ռŶתռ
@@ -404,6 +477,8 @@ Eigen::Vector3f displacement_fragment_shader(const fragment_shader_payload& payl
         
         // λƺλü˥ƽȶɣ
         Eigen::Vector3f attenuated_light = light.intensity / ((light.position - point).norm() * (light.position - point).norm());
+        // ӰеƬֻʣ
+        attenuated_light *= light_visibility(uniforms, light, point, normal);
         
         // === Blinn-Phongģ ===
         
@@ -445,29 +520,9 @@ Eigen::Vector3f displacement_fragment_shader(const fragment_shader_payload& payl
  */
 Eigen::Vector3f bump_fragment_shader(const fragment_shader_payload& payload)
 {
-    // === ʺ͹ղãȻ˴δڹռ㣬ԣ ===
-    Eigen::Vector3f ka = Eigen::Vector3f(0.005, 0.005, 0.005);  // ⷴϵ
-    Eigen::Vector3f kd = payload.color;                          // ϵɫ
-    Eigen::Vector3f ks = Eigen::Vector3f(0.7937, 0.7937, 0.7937); // 淴ϵ
-
-    // Դãʵнʾʵδйռ㣩
-    auto l1 = light{{20, 20, 20}, {500, 500, 500}};   // Դ
-    auto l2 = light{{-20, 20, 0}, {500, 500, 500}};   // Դ
-
-    std::vector<light> lights = {l1, l2};
-    Eigen::Vector3f amb_light_intensity{10, 10, 10};   // ǿ
-    Eigen::Vector3f eye_pos{0, 0, 10};                 // ۲λ
-
-    float p = 150;  // ߹ָ
-
-    // غȡ
-    Eigen::Vector3f color = payload.color; 
-    Eigen::Vector3f point = payload.view_pos;
+    // ͹ӳֻŶķռ
     Eigen::Vector3f normal = payload.normal;
 
-    // === ͹ӳĲ ===
-    float kh = 0.2, kn = 0.1;  // kh: ߶ϵkn: Ŷǿϵ
-
     // === ͹ӳ㷨ʵ ===
     
     // 1: ȡԭʼķ
@@ -477,7 +532,8 @@ Eigen::Vector3f bump_fragment_shader(const fragment_shader_payload& payload)
     // 2:  t
     // ʽt = (x*y/sqrt(x?+z?), sqrt(x?+z?), z*y/sqrt(x?+z?))
     // ʽȷ뷨ֱγ߿ռһ
-    Eigen::Vector3f t(x * y / sqrt(x * x + z * z), sqrt(x * x + z * z), z * y / sqrt(x * x + z * z));
+    float xz = sqrt(x * x + z * z);
+    Eigen::Vector3f t(x * y / xz, xz, z * y / xz);
     
     // 3:  b
     // b = n  t (Ĳ)
@@ -493,18 +549,15 @@ Eigen::Vector3f bump_fragment_shader(const fragment_shader_payload& payload)
            t[2], b[2], z;    // УTBNz
 
     // 5: ȡϢ
-    float w = payload.texture->width, h = payload.texture->height;  // ߴ
     float u = std::clamp(static_cast<double>(payload.tex_coords(0)), 0.0, 1.0);  // U[0,1]
     float v = std::clamp(static_cast<double>(payload.tex_coords(1)), 0.0, 1.0);  // V[0,1]
 
-    // 6: ߶ͼݶ
+    // 6: ȡԤĸ߶ͼݶ
     // dU = kh * kn * (h(u+1/w,v) - h(u,v)) - Uĸ߶ȱ仯
-    // ȽϵǰλҲصĸ߶ȲUݶ
-    float dU = kh * kn * (payload.texture->getColor(u + 1 / w, v).norm() - payload.texture->getColor(u, v).norm());
-    
-    // dV = kh * kn * (h(u,v+1/h) - h(u,v)) - Vĸ߶ȱ仯  
-    // ȽϵǰλϷصĸ߶ȲVݶ
-    float dV = kh * kn * (payload.texture->getColor(u, (v + 1) / h).norm() - payload.texture->getColor(u, v).norm());
+    // dV = kh * kn * (h(u,v+1/h) - h(u,v)) - Vĸ߶ȱ仯
+    // ǰλҲࡢϷصĸ߶Ȳ Texture::buildHeightMap ڼʱ
+    Eigen::Vector3f height_gradient = payload.texture->getHeightGradient(u, v);
+    float dU = height_gradient.y(), dV = height_gradient.z();
     
     // 7: ߿ռеķŶ
     // ln = (-dU, -dV, 1) - ߿ռеŶ
@@ -527,9 +580,470 @@ Eigen::Vector3f bump_fragment_shader(const fragment_shader_payload& payload)
     return result_color * 255.f;
 }
 
+// === Packet versions of the shaders above: 8 fragments per call, one per SIMD lane ===
+
+static simd::f32x8 clamp01(simd::f32x8 x)
+{
+    return simd::min(simd::max(x, simd::splat(0.0f)), simd::splat(1.0f));
+}
+
+static simd::vec3x8 splat(const Eigen::Vector3f& v)
+{
+    return simd::splat(v.x(), v.y(), v.z());
+}
+
+// light_visibility for 8 fragments
+static simd::f32x8 light_visibility(const lighting_uniforms& uniforms, const light& light, const simd::vec3x8& point,
+                                    const simd::vec3x8& normal)
+{
+    if (!uniforms.shadows)
+        return simd::splat(1.0f);
+    float px[simd::WIDTH], py[simd::WIDTH], pz[simd::WIDTH], nx[simd::WIDTH], ny[simd::WIDTH], nz[simd::WIDTH];
+    simd::store(px, point.x);
+    simd::store(py, point.y);
+    simd::store(pz, point.z);
+    simd::store(nx, normal.x);
+    simd::store(ny, normal.y);
+    simd::store(nz, normal.z);
+    float visibility[simd::WIDTH];
+    for (int lane = 0; lane < simd::WIDTH; ++lane)
+        visibility[lane] = light_visibility(uniforms, light, Eigen::Vector3f(px[lane], py[lane], pz[lane]),
+                                            Eigen::Vector3f(nx[lane], ny[lane], nz[lane]));
+    return simd::load(visibility);
+}
+
+// The Blinn-Phong loop shared by the phong, texture and displacement shaders
+static simd::vec3x8 blinn_phong(const fragment_packet& packet, const simd::vec3x8& kd, const simd::vec3x8& point,
+                                const simd::vec3x8& normal)
+{
+    const lighting_uniforms& uniforms = packet.uniforms<lighting_uniforms>();
+    simd::vec3x8 ka = splat(uniforms.ka);
+    simd::vec3x8 ks = splat(uniforms.ks);
+    simd::vec3x8 amb_light_intensity = splat(uniforms.amb_light_intensity);
+    simd::vec3x8 eye_pos = splat(uniforms.eye_pos);
+    int p = uniforms.p;
+
+    simd::vec3x8 view_dir = simd::normalized(eye_pos - point);
+    simd::vec3x8 ambient = ka * amb_light_intensity;
+    simd::vec3x8 result_color = simd::splat(0.0f, 0.0f, 0.0f);
+    for (auto& light : uniforms.lights)
+    {
+        simd::vec3x8 to_light = splat(light.position) - point;
+        simd::f32x8 r2 = simd::dot(to_light, to_light);
+        simd::vec3x8 light_dir = simd::normalized(to_light);
+        simd::vec3x8 h = simd::normalized(light_dir + view_dir);
+
+        simd::vec3x8 attenuated_light = splat(light.intensity) * (simd::splat(1.0f) / r2);
+        if (uniforms.shadows)
+            attenuated_light = attenuated_light * light_visibility(uniforms, light, point, normal);
+
+        simd::vec3x8 diffuse = kd * attenuated_light * simd::max(simd::splat(0.0f), simd::dot(normal, light_dir));
+        simd::vec3x8 specular = ks * attenuated_light * simd::pow(simd::max(simd::splat(0.0f), simd::dot(normal, h)), p);
+
+        result_color = result_color + diffuse + ambient + specular;
+    }
+    return result_color * simd::splat(255.0f);
+}
+
+simd::vec3x8 phong_packet_shader(const fragment_packet& packet)
+{
+    return blinn_phong(packet, packet.color, packet.view_pos, packet.normal);
+}
+
+simd::vec3x8 texture_packet_shader(const fragment_packet& packet)
+{
+    simd::vec3x8 texture_color = simd::splat(0.0f, 0.0f, 0.0f);
+    if (packet.texture)
+        texture_color = packet.texture->getColorTrilinear(clamp01(packet.tex_u), clamp01(packet.tex_v),
+                                                          packet.tex_du_dx, packet.tex_dv_dx,
+                                                          packet.tex_du_dy, packet.tex_dv_dy);
+    return blinn_phong(packet, texture_color * simd::splat(1.0f / 255.f), packet.view_pos, packet.normal);
+}
+
+// The perturbed normal of bump_fragment_shader / displacement_fragment_shader
+// for the height map gradient (dU, dV)
+static simd::vec3x8 bump_normal(const fragment_packet& packet, simd::f32x8 dU, simd::f32x8 dV)
+{
+    const simd::vec3x8& n = packet.normal;
+    simd::f32x8 xz = simd::sqrt(n.x * n.x + n.z * n.z);
+    simd::vec3x8 t{n.x * n.y / xz, xz, n.z * n.y / xz};
+    simd::vec3x8 b = simd::cross(n, t);
+
+    // TBN * (-dU, -dV, 1)
+    return simd::normalized(n - t * dU - b * dV);
+}
+
+simd::vec3x8 displacement_packet_shader(const fragment_packet& packet)
+{
+    // (height, dU, dV)
+    simd::vec3x8 height_gradient = packet.texture->getHeightGradient(clamp01(packet.tex_u), clamp01(packet.tex_v));
+    simd::vec3x8 normal = bump_normal(packet, height_gradient.y, height_gradient.z);
+    simd::vec3x8 point = packet.view_pos + packet.normal * (simd::splat(kn) * height_gradient.x);
+    return blinn_phong(packet, packet.color, point, normal);
+}
+
+simd::vec3x8 bump_packet_shader(const fragment_packet& packet)
+{
+    simd::vec3x8 height_gradient = packet.texture->getHeightGradient(clamp01(packet.tex_u), clamp01(packet.tex_v));
+    return bump_normal(packet, height_gradient.y, height_gradient.z) * simd::splat(255.0f);
+}
+
+using fragment_packet_fn = simd::vec3x8 (*)(const fragment_packet&);
+
+// Packet counterpart of static_shader
+template <fragment_packet_fn Shader>
+struct static_packet_shader
+{
+    simd::vec3x8 operator()(const fragment_packet& packet) const { return Shader(packet); }
+};
+
+using fragment_shader_fn = Eigen::Vector3f (*)(const fragment_shader_payload&);
+
+// Gives every shader function its own type, so rst::rasterizer::draw is
+// instantiated once per shader with the call inlined
+template <fragment_shader_fn Shader>
+struct static_shader
+{
+    Eigen::Vector3f operator()(const fragment_shader_payload& payload) const { return Shader(payload); }
+};
+
+// Calls draw with the function object of the active shader, which picks the
+// rasterizer's instantiation for it once per call
+template <typename Draw>
+static void with_shader(fragment_shader_fn shader, Draw draw)
+{
+    // every shader but the normal one has a packet version
+    if (shader == texture_fragment_shader)
+        draw(static_packet_shader<texture_packet_shader>{});
+    else if (shader == normal_fragment_shader)
+        draw(static_shader<normal_fragment_shader>{});
+    else if (shader == bump_fragment_shader)
+        draw(static_packet_shader<bump_packet_shader>{});
+    else if (shader == displacement_fragment_shader)
+        draw(static_packet_shader<displacement_packet_shader>{});
+    else
+        draw(static_packet_shader<phong_packet_shader>{});
+}
+
+static void draw_triangles(rst::rasterizer& r, rst::lod_buf_id mesh, fragment_shader_fn shader)
+{
+    with_shader(shader, [&](const auto& fragment_shader) { r.draw(mesh, fragment_shader); });
+}
+
+// Loads every level of the chain into r, for draw(lod_buf_id) to choose from
+static rst::lod_buf_id load_lods(rst::rasterizer& r, const std::vector<mesh_lod>& lods)
+{
+    std::vector<rst::lod_level> levels;
+    for (auto& level : lods)
+        levels.push_back({r.load_vertices(level.positions, level.normals, level.tex_coords),
+                          r.load_indices(level.indices), level.error});
+    return r.load_lods(levels);
+}
+
+// The passes a frame draws before its shaded one. Each worker or frame slot
+// rendering frames needs a copy of its own for the shadow maps' depth buffers;
+// the meshes they draw are shared with the rasterizer they were loaded into.
+struct frame_passes
+{
+    // a depth-only pass first, so the shaded pass only shades visible fragments
+    bool z_prepass = false;
+    // shadows[k] for lighting.lights[k], empty without shadows
+    std::vector<shadow_map> shadows;
+    lighting_uniforms lighting;
+    // bounding sphere of the mesh in model space, which the shadow maps are fitted to
+    Eigen::Vector3f center;
+    float radius;
+};
+
+// Starts a frame of r at angle and seen from eye_pos: clears it and sets its
+// matrices, renders the shadow maps for them and draws the Z-prepass, leaving
+// the shaded pass to the caller
+static void begin_frame(rst::rasterizer& r, frame_passes& passes, rst::lod_buf_id mesh, float angle,
+                        const Eigen::Vector3f& eye_pos)
+{
+    Eigen::Matrix4f model = get_model_matrix(angle);
+    Eigen::Matrix4f view = get_view_matrix(eye_pos);
+    r.clear(rst::Buffers::Color | rst::Buffers::Depth);
+    r.set_model(model);
+    r.set_view(view);
+    r.set_projection(get_projection_matrix(45.0, 1, 0.1, 50));
+
+    if (!passes.shadows.empty())
+    {
+        // ӰͼɫͬϸڲΣᱻһεԼڵ
+        int level = r.select_lod(mesh);
+        // Դ׶ǡðסģ͵İΧȾȼģ
+        Eigen::Matrix4f view_model = view * model;
+        Eigen::Vector3f center = (view_model * passes.center.homogeneous()).head<3>();
+        float radius = passes.radius * view_model.block<3, 3>(0, 0).colwise().norm().maxCoeff();
+        for (int k = 0; k < (int)passes.shadows.size(); ++k)
+        {
+            shadow_map& map = passes.shadows[k];
+            const Eigen::Vector3f& light_pos = passes.lighting.lights[k].position;
+            float distance = (center - light_pos).norm();
+            float fov = 2 * std::asin(std::min(radius / distance, 1.0f)) * 180 / MY_PI;
+            Eigen::Matrix4f light_view = get_look_at_matrix(light_pos, center);
+            Eigen::Matrix4f light_projection =
+                    get_projection_matrix(fov, 1, std::max(distance - radius, 0.1f), distance + radius);
+            map.light_clip = light_projection * light_view;
+
+            map.depth.clear(rst::Buffers::Depth);
+            map.depth.set_model(model);
+            map.depth.set_view(light_view * view);
+            map.depth.set_projection(light_projection);
+            const rst::lod_level& map_mesh = map.depth.get_lod(map.mesh, level);
+            map.depth.draw(map_mesh.vertices, map_mesh.indices);
+        }
+        passes.lighting.shadows = passes.shadows.data();
+        r.set_uniforms(passes.lighting);
+    }
+
+    if (passes.z_prepass)
+    {
+        r.set_shading(rst::Shading::DepthOnly);
+        r.draw(mesh);
+        r.set_shading(rst::Shading::Forward);
+    }
+}
+
+static void print_report(const std::string& name, const Texture::CompressionReport& report)
+{
+    std::cout << name << ": " << report.bytes / 1024 << " KiB instead of " << report.uncompressed_bytes / 1024
+              << " KiB, RMSE " << report.rmse << ", PSNR " << report.psnr << " dB, max error " << report.max_error
+              << "\n";
+}
+
+// Loads a texture in the given format, and for the block formats prints how
+// much memory compression saved and at what error
+static Texture load_texture(const std::string& path, Texture::Format format)
+{
+    Texture texture(path, format);
+    if (format != Texture::Format::RGB8)
+        print_report(path, texture.getCompressionReport());
+    return texture;
+}
+
+// One frame of a batch render
+struct frame_spec
+{
+    float angle;
+    Eigen::Vector3f eye_pos;
+};
+
+// Reads a batch spec file, one frame per line: "angle" or "angle eye_x eye_y eye_z".
+// Blank lines and lines starting with # are skipped.
+static std::vector<frame_spec> load_frame_specs(const std::string& path, const Eigen::Vector3f& default_eye)
+{
+    std::vector<frame_spec> frames;
+    std::ifstream file(path);
+    if (!file)
+        std::cerr << "Cannot open " << path << "\n";
+    std::string line;
+    while (std::getline(file, line))
+    {
+        std::istringstream fields(line);
+        frame_spec frame{0, default_eye};
+        if (line.empty() || line[0] == '#' || !(fields >> frame.angle))
+            continue;
+        float x, y, z;
+        if (fields >> x >> y >> z)
+            frame.eye_pos = Eigen::Vector3f(x, y, z);
+        frames.push_back(frame);
+    }
+    return frames;
+}
+
+// output.png, 7 -> output_0007.png
+static std::string frame_filename(const std::string& filename, int frame)
+{
+    char number[16];
+    std::snprintf(number, sizeof(number), "_%04d", frame);
+    size_t dot = filename.find_last_of('.');
+    if (dot == std::string::npos)
+        return filename + number;
+    return filename.substr(0, dot) + number + filename.substr(dot);
+}
+
+// Renders frames headless, with no window. The frames are independent, so
+// each worker thread renders whole frames with its own copy of r, and so its
+// own frame buffer. A draw then runs on a single thread, and the workers
+// never wait for each other. Encoding and writing the images is left to one
+// I/O thread, which workers hand their finished frames to.
+static void render_batch(const rst::rasterizer& r, const frame_passes& passes, rst::lod_buf_id mesh,
+                         fragment_shader_fn shader, const std::vector<frame_spec>& frames,
+                         const std::string& filename)
+{
+    int num_frames = (int)frames.size();
+    int num_workers = std::clamp((int)std::thread::hardware_concurrency(), 1, std::max(num_frames, 1));
+    auto start = std::chrono::steady_clock::now();
+
+    // frames waiting to be written. At most two per worker, so that a slow
+    // disk holds back rendering rather than piling up images.
+    std::mutex mutex;
+    std::condition_variable frame_ready, queue_space;
+    std::deque<std::pair<int, cv::Mat>> queue;
+    size_t max_queued = 2 * num_workers;
+
+    std::thread writer([&] {
+        for (int written = 0; written < num_frames; ++written)
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            frame_ready.wait(lock, [&] { return !queue.empty(); });
+            std::pair<int, cv::Mat> frame = std::move(queue.front());
+            queue.pop_front();
+            lock.unlock();
+            queue_space.notify_one();
+            cv::imwrite(frame_filename(filename, frame.first), frame.second);
+        }
+    });
+
+    std::atomic<int> next_frame(0);
+    std::vector<std::thread> workers;
+    for (int w = 0; w < num_workers; ++w)
+        workers.emplace_back([&] {
+            // the copies share r's buffers and texture; only the frame buffers
+            // and per-draw state are the worker's own
+            rst::rasterizer worker = r;
+            worker.set_threads(1);
+            frame_passes worker_passes = passes;
+            for (auto& map : worker_passes.shadows)
+                map.depth.set_threads(1);
+            for (int i = next_frame++; i < num_frames; i = next_frame++)
+            {
+                begin_frame(worker, worker_passes, mesh, frames[i].angle, frames[i].eye_pos);
+                draw_triangles(worker, mesh, shader);
+                // frame_image shares the frame buffer, which the next frame overwrites
+                cv::Mat image = worker.frame_image().clone();
+
+                std::unique_lock<std::mutex> lock(mutex);
+                queue_space.wait(lock, [&] { return queue.size() < max_queued; });
+                queue.emplace_back(i, std::move(image));
+                lock.unlock();
+                frame_ready.notify_one();
+            }
+        });
+    for (auto& worker : workers)
+        worker.join();
+    writer.join();
+
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::cout << "Rendered " << num_frames << " frames on " << num_workers << " threads in " << seconds
+              << " s (" << num_frames / seconds << " frames/s)\n";
+}
+
+// Frame slots handed from one stage of render_interactive to the next; pop
+// waits for one. A slot of -1 tells the next stage to stop.
+class slot_queue
+{
+public:
+    void push(int slot)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            slots.push_back(slot);
+        }
+        ready.notify_one();
+    }
+
+    int pop()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        ready.wait(lock, [&] { return !slots.empty(); });
+        int slot = slots.front();
+        slots.pop_front();
+        return slot;
+    }
+
+private:
+    std::mutex mutex;
+    std::condition_variable ready;
+    std::deque<int> slots;
+};
+
+// The window loop, with FRAMES_IN_FLIGHT frames in flight. Each frame goes
+// through three stages, each on a thread of its own:
+//  1. geometry: clear the buffers and draw the passes before the shaded one,
+//     then transform and bin the triangles
+//  2. shading: rasterize and shade the tiles
+//  3. presentation, on the main thread: show and save the image, read a key
+// Every frame in flight has its own copy of r, and so its own frame buffer and
+// bins; the copies share r's buffers and texture.
+// While frame N is shown, frame N+1 is shaded and frame N+2 binned, so frames
+// come at the pace of the slowest stage rather than of the three in turn.
+// The price is latency: a key shows FRAMES_IN_FLIGHT - 1 frames later.
+static void render_interactive(const rst::rasterizer& r, const frame_passes& passes, rst::lod_buf_id mesh,
+                               fragment_shader_fn shader, float angle, const Eigen::Vector3f& eye_pos,
+                               const std::string& filename)
+{
+    constexpr int FRAMES_IN_FLIGHT = 3;
+    // copying r and passes copies only frame buffers, bins and shadow depth
+    // buffers; the mesh and texture stay loaded once, shared by every slot
+    std::vector<rst::rasterizer> slots(FRAMES_IN_FLIGHT, r);
+    std::vector<frame_passes> slot_passes(FRAMES_IN_FLIGHT, passes);
+    // the model angle each slot is rendered at, set before it is queued for geometry
+    float slot_angle[FRAMES_IN_FLIGHT];
+    slot_queue to_geometry, to_shading, to_present;
+
+    std::thread geometry([&] {
+        for (int s = to_geometry.pop(); s >= 0; s = to_geometry.pop())
+        {
+            begin_frame(slots[s], slot_passes[s], mesh, slot_angle[s], eye_pos);
+            slots[s].bin(mesh);
+            to_shading.push(s);
+        }
+        to_shading.push(-1);
+    });
+    std::thread shading([&] {
+        for (int s = to_shading.pop(); s >= 0; s = to_shading.pop())
+        {
+            with_shader(shader, [&](const auto& fragment_shader) { slots[s].rasterize(fragment_shader); });
+            to_present.push(s);
+        }
+    });
+
+    for (int s = 0; s < FRAMES_IN_FLIGHT; ++s)
+    {
+        slot_angle[s] = angle;
+        to_geometry.push(s);
+    }
+
+    int key = 0;
+    while (key != 27)
+    {
+        int s = to_present.pop();
+        cv::Mat image = slots[s].frame_image();
+
+        cv::imshow("image", image);
+        cv::imwrite(filename, image);
+        key = cv::waitKey(10);
+
+        if (key == 'a' )
+        {
+            angle -= 0.1;
+        }
+        else if (key == 'd')
+        {
+            angle += 0.1;
+        }
+
+        // the slot is free again once its image is shown and saved
+        slot_angle[s] = angle;
+        to_geometry.push(s);
+    }
+
+    // frames still in flight are dropped
+    to_geometry.push(-1);
+    geometry.join();
+    shading.join();
+}
+
 int main(int argc, const char** argv)
 {
-    std::vector<Triangle*> TriangleList;
+    // the mesh as an indexed vertex buffer, so the rasterizer transforms each
+    // shared vertex once
+    std::vector<Eigen::Vector3f> positions, normals;
+    std::vector<Eigen::Vector2f> tex_coords;
+    std::vector<Eigen::Vector3i> indices;
 
     float angle = 140.0;
     bool command_line = false;
@@ -540,114 +1054,203 @@ int main(int argc, const char** argv)
 
     // Load .obj File
     bool loadout = Loader.LoadFile("models/spot/spot_triangulated_good.obj");
+    // the loader repeats a vertex for every face using it, so merge identical ones
+    std::map<std::array<float, 8>, int> vertex_index;
     for(auto mesh:Loader.LoadedMeshes)
     {
         for(int i=0;i<mesh.Vertices.size();i+=3)
         {
-            Triangle* t = new Triangle();
+            Eigen::Vector3i triangle;
             for(int j=0;j<3;j++)
             {
-                t->setVertex(j,Vector4f(mesh.Vertices[i+j].Position.X,mesh.Vertices[i+j].Position.Y,mesh.Vertices[i+j].Position.Z,1.0));
-                t->setNormal(j,Vector3f(mesh.Vertices[i+j].Normal.X,mesh.Vertices[i+j].Normal.Y,mesh.Vertices[i+j].Normal.Z));
-                t->setTexCoord(j,Vector2f(mesh.Vertices[i+j].TextureCoordinate.X, mesh.Vertices[i+j].TextureCoordinate.Y));
+                const objl::Vertex& vertex = mesh.Vertices[i+j];
+                std::array<float, 8> key = {vertex.Position.X, vertex.Position.Y, vertex.Position.Z,
+                                            vertex.Normal.X, vertex.Normal.Y, vertex.Normal.Z,
+                                            vertex.TextureCoordinate.X, vertex.TextureCoordinate.Y};
+                auto it = vertex_index.emplace(key, (int)positions.size());
+                if (it.second)
+                {
+                    positions.emplace_back(key[0], key[1], key[2]);
+                    normals.emplace_back(key[3], key[4], key[5]);
+                    tex_coords.emplace_back(key[6], key[7]);
+                }
+                triangle[j] = it.first->second;
             }
-            TriangleList.push_back(t);
+            indices.push_back(triangle);
         }
     }
 
+    // 򻯣ʱһϸڲΣLODʱĻϵĴСѡ
+    std::vector<mesh_lod> lods = build_lod_chain(positions, normals, tex_coords, indices);
+    std::cout << "Levels of detail:";
+    for (auto& level : lods)
+        std::cout << " " << level.indices.size();
+    std::cout << " triangles\n";
+
     rst::rasterizer r(700, 700);
+    rst::lod_buf_id mesh = load_lods(r, lods);
+
+    // trailing options, e.g. "output.png displacement deferred compressed shadows"
+    // lod=ϸڲεͶӰĻǵĬ 1ԽԽ绻ôֲڵĲ
+    // Ⱦturntable=N ģһȦȾ N ֡spec=ļ ļָ֡ǶȺӵ㣬
+    // Ϊ output_0000.png, output_0001.png, ...
+    bool deferred = false, compressed = false, prepass = false, shadows = false;
+    int turntable_frames = 0;
+    float lod_tolerance = 1;
+    std::string spec_path;
+    for (int i = 3; i < argc; ++i)
+    {
+        std::string option = argv[i];
+        deferred |= option == "deferred";
+        compressed |= option == "compressed";
+        prepass |= option == "prepass";
+        shadows |= option == "shadows";
+        if (option.rfind("turntable=", 0) == 0)
+            turntable_frames = std::max(std::atoi(option.c_str() + 10), 0);
+        else if (option.rfind("spec=", 0) == 0)
+            spec_path = option.substr(5);
+        else if (option.rfind("lod=", 0) == 0)
+            lod_tolerance = std::max((float)std::atof(option.c_str() + 4), 0.0f);
+    }
 
+    // ߶ͼǻҶͼѹʱֻ豣һͨBC4ɫBC1
     auto texture_path = "hmap.jpg";
-    r.set_texture(Texture(obj_path + texture_path));
-
-    std::function<Eigen::Vector3f(fragment_shader_payload)> active_shader = phong_fragment_shader;
+    Texture height_map(obj_path + texture_path, compressed ? Texture::Format::BC4 : Texture::Format::RGB8);
+    // ͹/λɫÿƬֻһθ߶Ⱥݶ
+    height_map.buildHeightMap(kh * kn);
+    // the bump and displacement shaders read only the height map, never the
+    // texels, so its size is the one they report
+    Texture::CompressionReport height_report = height_map.getHeightMapReport();
+    r.set_texture(std::move(height_map));
+
+    fragment_shader_fn active_shader = phong_fragment_shader;
+    // what the active shader reads from its payload
+    rst::Attributes active_attributes = rst::Attributes::Color | rst::Attributes::Normal | rst::Attributes::ViewPos;
 
     if (argc >= 2)
     {
         command_line = true;
         filename = std::string(argv[1]);
 
-        if (argc == 3 && std::string(argv[2]) == "texture")
+        if (argc >= 3 && std::string(argv[2]) == "texture")
         {
             std::cout << "Rasterizing using the texture shader\n";
             active_shader = texture_fragment_shader;
+            active_attributes = rst::Attributes::Normal | rst::Attributes::TexCoords | rst::Attributes::ViewPos;
             texture_path = "spot_texture.png";
-            r.set_texture(Texture(obj_path + texture_path));
+            r.set_texture(load_texture(obj_path + texture_path,
+                                       compressed ? Texture::Format::BC1 : Texture::Format::RGB8));
         }
-        else if (argc == 3 && std::string(argv[2]) == "normal")
+        else if (argc >= 3 && std::string(argv[2]) == "normal")
         {
             std::cout << "Rasterizing using the normal shader\n";
             active_shader = normal_fragment_shader;
+            active_attributes = rst::Attributes::Normal;
         }
-        else if (argc == 3 && std::string(argv[2]) == "phong")
+        else if (argc >= 3 && std::string(argv[2]) == "phong")
         {
             std::cout << "Rasterizing using the phong shader\n";
             active_shader = phong_fragment_shader;
+            active_attributes = rst::Attributes::Color | rst::Attributes::Normal | rst::Attributes::ViewPos;
         }
-        else if (argc == 3 && std::string(argv[2]) == "bump")
+        else if (argc >= 3 && std::string(argv[2]) == "bump")
         {
             std::cout << "Rasterizing using the bump shader\n";
             active_shader = bump_fragment_shader;
+            active_attributes = rst::Attributes::All;
+            print_report(obj_path + texture_path + " (height map)", height_report);
         }
-        else if (argc == 3 && std::string(argv[2]) == "displacement")
+        else if (argc >= 3 && std::string(argv[2]) == "displacement")
         {
             std::cout << "Rasterizing using the bump shader\n";
             active_shader = displacement_fragment_shader;
+            active_attributes = rst::Attributes::All;
+            print_report(obj_path + texture_path + " (height map)", height_report);
+        }
+
+        // shade each pixel once
+        if (deferred)
+        {
+            std::cout << "Using deferred shading\n";
+            r.set_shading(rst::Shading::Deferred);
         }
     }
 
+    // Z-prepassֻȣɫ׶ֻԿɼƬεɫӳɫֻɫһΣ
+    frame_passes passes;
+    passes.z_prepass = prepass && !deferred;
+    if (passes.z_prepass)
+        std::cout << "Using a depth prepass\n";
+
     Eigen::Vector3f eye_pos = {0,0,10};
 
     r.set_vertex_shader(vertex_shader);
-    r.set_fragment_shader(active_shader);
-
-    int key = 0;
-    int frame_count = 0;
-
-    if (command_line)
+    r.set_fragment_shader(active_shader, active_attributes);
+    // պͲʳֻһΣÿƬ¹
+    lighting_uniforms lighting;
+    lighting.ka = Eigen::Vector3f(0.005, 0.005, 0.005);
+    lighting.ks = Eigen::Vector3f(0.7937, 0.7937, 0.7937);
+    lighting.lights[0] = light{{20, 20, 20}, {500, 500, 500}};   // Դǰ
+    lighting.lights[1] = light{{-20, 20, 0}, {500, 500, 500}};   // ԴϷ
+    lighting.amb_light_intensity = Eigen::Vector3f(10, 10, 10);
+    lighting.eye_pos = Eigen::Vector3f(0, 0, 10);
+    lighting.p = 150;
+    r.set_uniforms(lighting);
+    passes.lighting = lighting;
+    // spot is a closed mesh: its back faces are always hidden behind front ones
+    r.set_culling(rst::Culling::Back);
+    r.set_lod_tolerance(lod_tolerance);
+    // shaders write straight into 8-bit BGRA, which OpenCV shows and saves as is
+    r.set_frame_format(rst::FrameFormat::BGRA8);
+
+    // ӰÿԴһӰͼÿ֡ɫǰֻдȵһӹԴȾ
+    if (shadows)
     {
-        r.clear(rst::Buffers::Color | rst::Buffers::Depth);
-        r.set_model(get_model_matrix(angle));
-        r.set_view(get_view_matrix(eye_pos));
-        r.set_projection(get_projection_matrix(45.0, 1, 0.1, 50));
-
-        r.draw(TriangleList);
-        cv::Mat image(700, 700, CV_32FC3, r.frame_buffer().data());
-        image.convertTo(image, CV_8UC3, 1.0f);
-        cv::cvtColor(image, image, cv::COLOR_RGB2BGR);
+        std::cout << "Rendering shadow maps\n";
+        Eigen::Vector3f lo = positions[0], hi = positions[0];
+        for (auto& position : positions)
+        {
+            lo = lo.cwiseMin(position);
+            hi = hi.cwiseMax(position);
+        }
+        passes.center = (lo + hi) / 2;
+        passes.radius = 0;
+        for (auto& position : positions)
+            passes.radius = std::max(passes.radius, (position - passes.center).norm());
 
-        cv::imwrite(filename, image);
+        for (int k = 0; k < 2; ++k)
+        {
+            shadow_map map;
+            map.depth.set_shading(rst::Shading::DepthOnly);
+            map.depth.set_culling(rst::Culling::Back);
+            map.depth.share_buffers(r);
+            map.mesh = mesh;
+            passes.shadows.push_back(std::move(map));
+        }
+    }
 
+    if (command_line && (turntable_frames > 0 || !spec_path.empty()))
+    {
+        std::vector<frame_spec> frames;
+        if (!spec_path.empty())
+            frames = load_frame_specs(spec_path, eye_pos);
+        for (int i = 0; i < turntable_frames; ++i)
+            frames.push_back({angle + 360.0f * i / turntable_frames, eye_pos});
+        render_batch(r, passes, mesh, active_shader, frames, filename);
         return 0;
     }
 
-    while(key != 27)
+    if (command_line)
     {
-        r.clear(rst::Buffers::Color | rst::Buffers::Depth);
-
-        r.set_model(get_model_matrix(angle));
-        r.set_view(get_view_matrix(eye_pos));
-        r.set_projection(get_projection_matrix(45.0, 1, 0.1, 50));
-
-        //r.draw(pos_id, ind_id, col_id, rst::Primitive::Triangle);
-        r.draw(TriangleList);
-        cv::Mat image(700, 700, CV_32FC3, r.frame_buffer().data());
-        image.convertTo(image, CV_8UC3, 1.0f);
-        cv::cvtColor(image, image, cv::COLOR_RGB2BGR);
-
-        cv::imshow("image", image);
-        cv::imwrite(filename, image);
-        key = cv::waitKey(10);
-
-        if (key == 'a' )
-        {
-            angle -= 0.1;
-        }
-        else if (key == 'd')
-        {
-            angle += 0.1;
-        }
+        begin_frame(r, passes, mesh, angle, eye_pos);
+        int level = r.select_lod(mesh);
+        std::cout << "Drawing level of detail " << level << " (" << lods[level].indices.size() << " triangles)\n";
+        draw_triangles(r, mesh, active_shader);
+        cv::imwrite(filename, r.frame_image());
 
+        return 0;
     }
+
+    render_interactive(r, passes, mesh, active_shader, angle, eye_pos, filename);
     return 0;
 }
@@ -6,12 +6,16 @@
 #include "rasterizer.hpp"
 #include <opencv2/opencv.hpp>
 #include <math.h>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
 
 
 rst::pos_buf_id rst::rasterizer::load_positions(const std::vector<Eigen::Vector3f> &positions)
 {
     auto id = get_next_id();
-    pos_buf.emplace(id, positions);
+    pos_buf.emplace(id, std::make_shared<const std::vector<Eigen::Vector3f>>(positions));
 
     return {id};
 }
@@ -19,7 +23,7 @@ rst::pos_buf_id rst::rasterizer::load_positions(const std::vector<Eigen::Vector3
 rst::ind_buf_id rst::rasterizer::load_indices(const std::vector<Eigen::Vector3i> &indices)
 {
     auto id = get_next_id();
-    ind_buf.emplace(id, indices);
+    ind_buf.emplace(id, std::make_shared<const std::vector<Eigen::Vector3i>>(indices));
 
     return {id};
 }
@@ -27,7 +31,7 @@ rst::ind_buf_id rst::rasterizer::load_indices(const std::vector<Eigen::Vector3i>
 rst::col_buf_id rst::rasterizer::load_colors(const std::vector<Eigen::Vector3f> &cols)
 {
     auto id = get_next_id();
-    col_buf.emplace(id, cols);
+    col_buf.emplace(id, std::make_shared<const std::vector<Eigen::Vector3f>>(cols));
 
     return {id};
 }
@@ -35,13 +39,67 @@ rst::col_buf_id rst::rasterizer::load_colors(const std::vector<Eigen::Vector3f>
 rst::col_buf_id rst::rasterizer::load_normals(const std::vector<Eigen::Vector3f>& normals)
 {
     auto id = get_next_id();
-    nor_buf.emplace(id, normals);
+    nor_buf.emplace(id, std::make_shared<const std::vector<Eigen::Vector3f>>(normals));
 
     normal_id = id;
 
     return {id};
 }
 
+rst::vert_buf_id rst::rasterizer::load_vertices(const std::vector<Eigen::Vector3f>& positions,
+                                                const std::vector<Eigen::Vector3f>& normals,
+                                                const std::vector<Eigen::Vector2f>& tex_coords)
+{
+    int count = (int)positions.size();
+    int padded = (count + simd::WIDTH - 1) / simd::WIDTH * simd::WIDTH;
+
+    vertex_buffer vb;
+    vb.count = count;
+    for (auto* a : {&vb.x, &vb.y, &vb.z, &vb.nx, &vb.ny, &vb.nz, &vb.u, &vb.v})
+        a->assign(padded, 0.0f);
+    for (int i = 0; i < count; ++i)
+    {
+        vb.x[i] = positions[i].x();
+        vb.y[i] = positions[i].y();
+        vb.z[i] = positions[i].z();
+        vb.nx[i] = normals[i].x();
+        vb.ny[i] = normals[i].y();
+        vb.nz[i] = normals[i].z();
+        vb.u[i] = tex_coords[i].x();
+        vb.v[i] = tex_coords[i].y();
+    }
+
+    auto id = get_next_id();
+    vert_buf.emplace(id, std::make_shared<const vertex_buffer>(std::move(vb)));
+
+    return {id};
+}
+
+rst::lod_buf_id rst::rasterizer::load_lods(const std::vector<lod_level>& levels)
+{
+    lod_chain chain;
+    chain.levels = levels;
+
+    // every level lies about the finest, so its bounding sphere does for all
+    const vertex_buffer& vb = *vert_buf.at(levels[0].vertices.vert_id);
+    Eigen::Vector3f lo = Eigen::Vector3f::Constant(std::numeric_limits<float>::infinity());
+    Eigen::Vector3f hi = -lo;
+    for (int i = 0; i < vb.count; ++i)
+    {
+        lo = lo.cwiseMin(Eigen::Vector3f(vb.x[i], vb.y[i], vb.z[i]));
+        hi = hi.cwiseMax(Eigen::Vector3f(vb.x[i], vb.y[i], vb.z[i]));
+    }
+    chain.center = (lo + hi) / 2;
+    chain.radius = 0;
+    for (int i = 0; i < vb.count; ++i)
+        chain.radius = std::max(chain.radius, (Eigen::Vector3f(vb.x[i], vb.y[i], vb.z[i]) - chain.center).norm());
+
+    auto id = get_next_id();
+    lod_buf.emplace(id, std::make_shared<const lod_chain>(std::move(chain)));
+
+    return {id};
+}
+
 
 // Bresenham's line drawing algorithm
 void rst::rasterizer::draw_line(Eigen::Vector3f begin, Eigen::Vector3f end)
@@ -149,202 +207,688 @@ auto to_vec4(const Eigen::Vector3f& v3, float w = 1.0f)
     return Vector4f(v3.x(), v3.y(), v3.z(), w);
 }
 
-static bool insideTriangle(int x, int y, const Vector4f* _v){
-    Vector3f v[3];
-    for(int i=0;i<3;i++)
-        v[i] = {_v[i].x(),_v[i].y(), 1.0};
-    Vector3f f0,f1,f2;
-    f0 = v[1].cross(v[0]);
-    f1 = v[2].cross(v[1]);
-    f2 = v[0].cross(v[2]);
-    Vector3f p(x,y,1.);
-    if((p.dot(f0)*f0.dot(v[2])>0) && (p.dot(f1)*f1.dot(v[0])>0) && (p.dot(f2)*f2.dot(v[1])>0))
-        return true;
-    return false;
+// Screen space extent, in pixels from the origin, that keeps the edge values
+// inside a partially covered block within 32 bits
+constexpr float GUARD_BAND = 8192.0f;
+
+// Clip planes, as the coefficients of a clip space position whose dot product
+// with the position is negative outside. The first six bound the view volume
+// -w <= x, y, z <= w; the guard band planes keep the screen position within
+// GUARD_BAND / 2 of the screen center (for screens smaller than GUARD_BAND).
+enum clip_plane
+{
+    CLIP_LEFT, CLIP_RIGHT, CLIP_BOTTOM, CLIP_TOP, CLIP_NEAR, CLIP_FAR,
+    CLIP_GUARD_LEFT, CLIP_GUARD_RIGHT, CLIP_GUARD_BOTTOM, CLIP_GUARD_TOP,
+    NUM_CLIP_PLANES
+};
+// outcode bits of a vertex outside the view volume
+constexpr int CLIP_FRUSTUM = (1 << CLIP_GUARD_LEFT) - 1;
+// outcode bits of the planes triangles are actually clipped against; the
+// guard band makes clipping against the sides of the view volume unnecessary
+constexpr int CLIP_NEEDED = (1 << CLIP_NEAR) | (1 << CLIP_FAR) | (((1 << NUM_CLIP_PLANES) - 1) & ~CLIP_FRUSTUM);
+
+static std::array<Eigen::Vector4f, NUM_CLIP_PLANES> clip_planes(int width, int height)
+{
+    float gx = GUARD_BAND / width, gy = GUARD_BAND / height;
+    return {Eigen::Vector4f(1, 0, 0, 1), Eigen::Vector4f(-1, 0, 0, 1),
+            Eigen::Vector4f(0, 1, 0, 1), Eigen::Vector4f(0, -1, 0, 1),
+            Eigen::Vector4f(0, 0, 1, 1), Eigen::Vector4f(0, 0, -1, 1),
+            Eigen::Vector4f(1, 0, 0, gx), Eigen::Vector4f(-1, 0, 0, gx),
+            Eigen::Vector4f(0, 1, 0, gy), Eigen::Vector4f(0, -1, 0, gy)};
 }
 
-static std::tuple<float, float, float> computeBarycentric2D(float x, float y, const Vector4f* v){
-    float c1 = (x*(v[1].y() - v[2].y()) + (v[2].x() - v[1].x())*y + v[1].x()*v[2].y() - v[2].x()*v[1].y()) / (v[0].x()*(v[1].y() - v[2].y()) + (v[2].x() - v[1].x())*v[0].y() + v[1].x()*v[2].y() - v[2].x()*v[1].y());
-    float c2 = (x*(v[2].y() - v[0].y()) + (v[0].x() - v[2].x())*y + v[2].x()*v[0].y() - v[0].x()*v[2].y()) / (v[1].x()*(v[2].y() - v[0].y()) + (v[0].x() - v[2].x())*v[1].y() + v[2].x()*v[0].y() - v[0].x()*v[2].y());
-    float c3 = (x*(v[0].y() - v[1].y()) + (v[1].x() - v[0].x())*y + v[0].x()*v[1].y() - v[1].x()*v[0].y()) / (v[2].x()*(v[0].y() - v[1].y()) + (v[1].x() - v[0].x())*v[2].y() + v[0].x()*v[1].y() - v[1].x()*v[0].y());
-    return {c1,c2,c3};
+// Twice the signed screen space area of the clip space triangle, scaled by
+// w0 * w1 * w2: positive for counter-clockwise triangles on screen, whatever
+// the signs of their w, so it decides facing before any clipping
+static float facing(const Eigen::Vector4f* c)
+{
+    Eigen::Matrix3f m;
+    for (int k = 0; k < 3; ++k)
+        m.row(k) << c[k].x(), c[k].y(), c[k].w();
+    return m.determinant();
 }
 
-void rst::rasterizer::draw(std::vector<Triangle *> &TriangleList) {
+// A vertex of a clipped polygon: its clip space position and the attributes
+// that are interpolated along with it
+struct clip_vertex
+{
+    Eigen::Vector4f pos;
+    Eigen::Vector3f view_pos, normal;
+    Eigen::Vector2f tex_coords;
+};
+
+// Sutherland-Hodgman: clips the convex polygon in[0..n) against one plane into
+// out and returns its new vertex count, at most n + 1
+static int clip_polygon(const clip_vertex* in, int n, const Eigen::Vector4f& plane, clip_vertex* out)
+{
+    int count = 0;
+    for (int i = 0; i < n; ++i)
+    {
+        const clip_vertex& a = in[i];
+        const clip_vertex& b = in[(i + 1) % n];
+        float da = plane.dot(a.pos), db = plane.dot(b.pos);
+        if (da >= 0)
+            out[count++] = a;
+        if ((da >= 0) != (db >= 0))
+        {
+            float t = da / (da - db);
+            out[count++] = {a.pos + t * (b.pos - a.pos), a.view_pos + t * (b.view_pos - a.view_pos),
+                            a.normal + t * (b.normal - a.normal),
+                            a.tex_coords + t * (b.tex_coords - a.tex_coords)};
+        }
+    }
+    return count;
+}
 
-    float f1 = (50 - 0.1) / 2.0;
-    float f2 = (50 + 0.1) / 2.0;
+// Sets up the fixed-point edge functions of the screen space triangle v, wound
+// so that the inside is positive. Returns false for triangles without area and
+// for ones reaching past the guard band the fixed-point range covers.
+static bool setup_edges(const Eigen::Vector4f* v, std::array<rst::edge_eq, 3>& edge, float& inv_area)
+{
+    constexpr int SUBPIXEL = 16;
 
-    Eigen::Matrix4f mvp = projection * view * model;
-    for (const auto& t:TriangleList)
+    int64_t x[3], y[3];
+    for (int k = 0; k < 3; ++k)
     {
-        Triangle newtri = *t;
-
-        std::array<Eigen::Vector4f, 3> mm {
-                (view * model * t->v[0]),
-                (view * model * t->v[1]),
-                (view * model * t->v[2])
-        };
+        if (!(std::abs(v[k].x()) < GUARD_BAND && std::abs(v[k].y()) < GUARD_BAND))
+            return false;
+        x[k] = std::lround(v[k].x() * SUBPIXEL);
+        y[k] = std::lround(v[k].y() * SUBPIXEL);
+    }
 
-        std::array<Eigen::Vector3f, 3> viewspace_pos;
+    int64_t area = (x[1] - x[0]) * (y[2] - y[0]) - (x[2] - x[0]) * (y[1] - y[0]);
+    if (area == 0)
+        return false;
+    int64_t sign = area > 0 ? 1 : -1;
 
-        std::transform(mm.begin(), mm.end(), viewspace_pos.begin(), [](auto& v) {
-            return v.template head<3>();
-        });
+    for (int k = 0; k < 3; ++k)
+    {
+        int j = (k + 1) % 3, l = (k + 2) % 3;
+        int64_t a = sign * (y[j] - y[l]);
+        int64_t b = sign * (x[l] - x[j]);
+        int64_t c = sign * (x[j] * y[l] - x[l] * y[j]);
+        // pixel centers exactly on an edge only belong to its left or top side
+        bool top_left = a > 0 || (a == 0 && b < 0);
+        edge[k].a = (int32_t)(a * SUBPIXEL);
+        edge[k].b = (int32_t)(b * SUBPIXEL);
+        edge[k].c = c + (a + b) * (SUBPIXEL / 2) - (top_left ? 0 : 1);
+    }
+    inv_area = (float)(1.0 / (double)(area * sign));
+    return true;
+}
 
-        Eigen::Vector4f v[] = {
-                mvp * t->v[0],
-                mvp * t->v[1],
-                mvp * t->v[2]
-        };
-        //Homogeneous division
-        for (auto& vec : v) {
-            vec.x()/=vec.w();
-            vec.y()/=vec.w();
-            vec.z()/=vec.w();
+// One run_parallel call: its workers are claimed one at a time, by the
+// calling thread and by any pool thread that picks the call up
+struct parallel_job
+{
+    const std::function<void(int)>* job;
+    int num_workers;
+    std::atomic<int> next_worker{1};
+    std::mutex mutex;
+    std::condition_variable finished;
+    int num_done = 0;
+
+    // runs unclaimed workers until there are none left
+    void work()
+    {
+        for (int w = next_worker++; w < num_workers; w = next_worker++)
+        {
+            (*job)(w);
+            std::lock_guard<std::mutex> lock(mutex);
+            if (++num_done == num_workers - 1)
+                finished.notify_one();
         }
+    }
+};
+
+// Threads started once and kept for the life of the program, shared by every
+// rasterizer, so a draw does not start and join threads for each of its
+// phases. Several rasterizers may run jobs at once: a pool thread takes
+// whichever job was queued first, and a caller works on its own job too, so
+// it finishes even when every pool thread is busy elsewhere.
+class worker_pool
+{
+public:
+    worker_pool()
+    {
+        int n = std::max(1, (int)std::thread::hardware_concurrency() - 1);
+        for (int i = 0; i < n; ++i)
+            threads.emplace_back([this] { loop(); });
+    }
+    ~worker_pool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        ready.notify_all();
+        for (auto& t : threads)
+            t.join();
+    }
 
-        Eigen::Matrix4f inv_trans = (view * model).inverse().transpose();
-        Eigen::Vector4f n[] = {
-                inv_trans * to_vec4(t->normal[0], 0.0f),
-                inv_trans * to_vec4(t->normal[1], 0.0f),
-                inv_trans * to_vec4(t->normal[2], 0.0f)
-        };
+    static worker_pool& instance()
+    {
+        static worker_pool pool;
+        return pool;
+    }
 
-        //Viewport transformation
-        for (auto & vert : v)
+    // Offers pj to up to count pool threads
+    void submit(const std::shared_ptr<parallel_job>& pj, int count)
+    {
+        count = std::min(count, (int)threads.size());
         {
-            vert.x() = 0.5*width*(vert.x()+1.0);
-            vert.y() = 0.5*height*(vert.y()+1.0);
-            vert.z() = vert.z() * f1 + f2;
+            std::lock_guard<std::mutex> lock(mutex);
+            for (int i = 0; i < count; ++i)
+                queue.push_back(pj);
         }
+        if (count == 1)
+            ready.notify_one();
+        else
+            ready.notify_all();
+    }
 
-        for (int i = 0; i < 3; ++i)
+private:
+    void loop()
+    {
+        for (;;)
         {
-            //screen space coordinates
-            newtri.setVertex(i, v[i]);
+            std::shared_ptr<parallel_job> pj;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                ready.wait(lock, [&] { return stopping || !queue.empty(); });
+                if (queue.empty())
+                    return;
+                pj = std::move(queue.front());
+                queue.pop_front();
+            }
+            pj->work();
         }
+    }
+
+    std::vector<std::thread> threads;
+    std::mutex mutex;
+    std::condition_variable ready;
+    // a job is queued once per pool thread it is offered to, and held until
+    // the last of them has seen it
+    std::deque<std::shared_ptr<parallel_job>> queue;
+    bool stopping = false;
+};
 
-        for (int i = 0; i < 3; ++i)
+void rst::rasterizer::run_parallel(int num_threads, const std::function<void(int)>& job)
+{
+    if (num_threads <= 1)
+    {
+        job(0);
+        return;
+    }
+
+    auto pj = std::make_shared<parallel_job>();
+    pj->job = &job;
+    pj->num_workers = num_threads;
+    worker_pool::instance().submit(pj, num_threads - 1);
+    job(0);
+    pj->work();
+    std::unique_lock<std::mutex> lock(pj->mutex);
+    pj->finished.wait(lock, [&] { return pj->num_done == num_threads - 1; });
+}
+
+void rst::rasterizer::transform_vertices(const vertex_buffer& vb)
+{
+    float f1 = (50 - 0.1) / 2.0;
+    float f2 = (50 + 0.1) / 2.0;
+
+    // per-draw uniforms, rather than per triangle
+    Eigen::Matrix4f view_model = view * model;
+    Eigen::Matrix4f mvp = projection * view_model;
+    Eigen::Matrix4f inv_trans = view_model.inverse().transpose();
+
+    int padded = (int)vb.x.size();
+    for (auto* a : {&vcache.x, &vcache.y, &vcache.z, &vcache.w, &vcache.cx, &vcache.cy, &vcache.cz,
+                    &vcache.vx, &vcache.vy, &vcache.vz, &vcache.nx, &vcache.ny, &vcache.nz})
+        a->resize(padded);
+    vcache.clip_code.resize(padded);
+    auto planes = clip_planes(width, height);
+
+    // row r of m times (p, w), one vertex per lane
+    auto row = [](const Eigen::Matrix4f& m, int r, const simd::vec3x8& p, float w) {
+        return simd::splat(m(r, 0)) * p.x + simd::splat(m(r, 1)) * p.y + simd::splat(m(r, 2)) * p.z +
+               simd::splat(m(r, 3) * w);
+    };
+
+    // a depth-only pass needs neither the view space position nor the normal
+    const bool depth_only = shading == Shading::DepthOnly;
+    int num_packets = padded / simd::WIDTH;
+    run_parallel(num_threads, [&](int worker) {
+        int begin = (int)((long long)num_packets * worker / num_threads) * simd::WIDTH;
+        int end = (int)((long long)num_packets * (worker + 1) / num_threads) * simd::WIDTH;
+        for (int i = begin; i < end; i += simd::WIDTH)
         {
+            simd::vec3x8 p{simd::load(&vb.x[i]), simd::load(&vb.y[i]), simd::load(&vb.z[i])};
+
+            simd::f32x8 cx = row(mvp, 0, p, 1), cy = row(mvp, 1, p, 1), cz = row(mvp, 2, p, 1);
+            simd::f32x8 w = row(mvp, 3, p, 1);
+            simd::store(&vcache.cx[i], cx);
+            simd::store(&vcache.cy[i], cy);
+            simd::store(&vcache.cz[i], cz);
+            simd::store(&vcache.w[i], w);
+
+            //Homogeneous division and viewport transformation; meaningless for
+            //vertices outside the near plane, which clipping replaces
+            simd::f32x8 one = simd::splat(1.0f);
+            simd::store(&vcache.x[i], simd::splat(0.5f * width) * (cx / w + one));
+            simd::store(&vcache.y[i], simd::splat(0.5f * height) * (cy / w + one));
+            simd::store(&vcache.z[i], cz / w * simd::splat(f1) + simd::splat(f2));
+
+            for (int j = i; j < i + simd::WIDTH; ++j)
+            {
+                Eigen::Vector4f c(vcache.cx[j], vcache.cy[j], vcache.cz[j], vcache.w[j]);
+                int code = 0;
+                for (int plane = 0; plane < NUM_CLIP_PLANES; ++plane)
+                    code |= (planes[plane].dot(c) < 0) << plane;
+                vcache.clip_code[j] = (uint16_t)code;
+            }
+
+            if (depth_only)
+                continue;
+
+            simd::store(&vcache.vx[i], row(view_model, 0, p, 1));
+            simd::store(&vcache.vy[i], row(view_model, 1, p, 1));
+            simd::store(&vcache.vz[i], row(view_model, 2, p, 1));
+
             //view space normal
-            newtri.setNormal(i, n[i].head<3>());
+            simd::vec3x8 n{simd::load(&vb.nx[i]), simd::load(&vb.ny[i]), simd::load(&vb.nz[i])};
+            simd::store(&vcache.nx[i], row(inv_trans, 0, n, 0));
+            simd::store(&vcache.ny[i], row(inv_trans, 1, n, 0));
+            simd::store(&vcache.nz[i], row(inv_trans, 2, n, 0));
+        }
+    });
+}
+
+Eigen::Vector4f rst::rasterizer::to_screen(const Eigen::Vector4f& clip) const
+{
+    float f1 = (50 - 0.1) / 2.0;
+    float f2 = (50 + 0.1) / 2.0;
+
+    return Eigen::Vector4f(0.5f * width * (clip.x() / clip.w() + 1.0f), 0.5f * height * (clip.y() / clip.w() + 1.0f),
+                           clip.z() / clip.w() * f1 + f2, clip.w());
+}
+
+int rst::rasterizer::assemble(const vertex_buffer& vb, const Eigen::Vector3i& tri, setup_triangle& first,
+                              std::vector<setup_triangle>& extra)
+{
+    int code[3];
+    for (int k = 0; k < 3; ++k)
+        code[k] = vcache.clip_code[tri[k]];
+
+    // frustum culling: every vertex outside the same plane
+    if (code[0] & code[1] & code[2] & CLIP_FRUSTUM)
+        return 0;
+
+    Eigen::Vector4f clip[3];
+    for (int k = 0; k < 3; ++k)
+    {
+        int i = tri[k];
+        clip[k] = Eigen::Vector4f(vcache.cx[i], vcache.cy[i], vcache.cz[i], vcache.w[i]);
+    }
+    if (culling == Culling::Back && facing(clip) <= 0)
+        return 0;
+
+    // gather the vertices from the post-transform cache
+    Eigen::Vector4f v[3];
+    std::array<Eigen::Vector3f, 3> view_pos, normal;
+    std::array<Eigen::Vector2f, 3> tex_coords;
+    for (int k = 0; k < 3; ++k)
+    {
+        int i = tri[k];
+        v[k] = Eigen::Vector4f(vcache.x[i], vcache.y[i], vcache.z[i], vcache.w[i]);
+        view_pos[k] = Eigen::Vector3f(vcache.vx[i], vcache.vy[i], vcache.vz[i]);
+        normal[k] = Eigen::Vector3f(vcache.nx[i], vcache.ny[i], vcache.nz[i]);
+        tex_coords[k] = Eigen::Vector2f(vb.u[i], vb.v[i]);
+    }
+
+    int crossed = (code[0] | code[1] | code[2]) & CLIP_NEEDED;
+    if (!crossed)
+    {
+        first = setup(v, view_pos, normal, tex_coords);
+        return first.visible ? 1 : 0;
+    }
+
+    // Clip against only the planes some vertex is outside of. Each plane adds
+    // at most one vertex to the polygon.
+    clip_vertex poly[2][3 + NUM_CLIP_PLANES];
+    int n = 3, cur = 0;
+    for (int k = 0; k < 3; ++k)
+        poly[0][k] = {clip[k], view_pos[k], normal[k], tex_coords[k]};
+    auto planes = clip_planes(width, height);
+    for (int plane = 0; plane < NUM_CLIP_PLANES && n >= 3; ++plane)
+    {
+        if (!(crossed >> plane & 1))
+            continue;
+        n = clip_polygon(poly[cur], n, planes[plane], poly[1 - cur]);
+        cur = 1 - cur;
+    }
+
+    // the clipped polygon is convex: fan it out from its first vertex
+    int count = 0;
+    for (int k = 1; k + 1 < n; ++k)
+    {
+        const clip_vertex* fan[] = {&poly[cur][0], &poly[cur][k], &poly[cur][k + 1]};
+        for (int j = 0; j < 3; ++j)
+        {
+            v[j] = to_screen(fan[j]->pos);
+            view_pos[j] = fan[j]->view_pos;
+            normal[j] = fan[j]->normal;
+            tex_coords[j] = fan[j]->tex_coords;
+        }
+        setup_triangle st = setup(v, view_pos, normal, tex_coords);
+        if (!st.visible)
+            continue;
+        if (count++ == 0)
+            first = st;
+        else
+            extra.push_back(st);
+    }
+    return count;
+}
+
+rst::rasterizer::setup_triangle rst::rasterizer::setup(const Eigen::Vector4f* v,
+                                                       const std::array<Eigen::Vector3f, 3>& view_pos,
+                                                       const std::array<Eigen::Vector3f, 3>& normal,
+                                                       const std::array<Eigen::Vector2f, 3>& tex_coords)
+{
+    setup_triangle st;
+    Eigen::Vector3f base_color = Eigen::Vector3f(148, 121.0, 92.0) / 255.0f;
+    std::array<Eigen::Vector3f, 3> color = {base_color, base_color, base_color};
+
+    st.visible = setup_edges(v, st.edge, st.inv_area);
+    if (!st.visible)
+        return st;
+
+    st.min_x = std::max(0, (int)std::floor(std::min({v[0].x(), v[1].x(), v[2].x()})));
+    st.max_x = std::min(width - 1, (int)std::floor(std::max({v[0].x(), v[1].x(), v[2].x()})));
+    st.min_y = std::max(0, (int)std::floor(std::min({v[0].y(), v[1].y(), v[2].y()})));
+    st.max_y = std::min(height - 1, (int)std::floor(std::max({v[0].y(), v[1].y(), v[2].y()})));
+    st.visible = st.min_x <= st.max_x && st.min_y <= st.max_y;
+    if (!st.visible)
+        return st;
+    st.min_z = std::min({v[0].z(), v[1].z(), v[2].z()});
+    st.max_z = std::max({v[0].z(), v[1].z(), v[2].z()});
+
+    // Attribute planes. The barycentric weights of vertices 1 and 2 are planes
+    // themselves, and any per-vertex value f interpolates as
+    // f0 + (f1 - f0) * beta + (f2 - f0) * gamma.
+    float beta = st.edge[1].at(st.min_x, st.min_y) * st.inv_area;
+    float gamma = st.edge[2].at(st.min_x, st.min_y) * st.inv_area;
+    float beta_dx = st.edge[1].a * st.inv_area, beta_dy = st.edge[1].b * st.inv_area;
+    float gamma_dx = st.edge[2].a * st.inv_area, gamma_dy = st.edge[2].b * st.inv_area;
+    auto make_plane = [&](float f0, float f1, float f2) {
+        return attr_plane{f0 + (f1 - f0) * beta + (f2 - f0) * gamma,
+                          (f1 - f0) * beta_dx + (f2 - f0) * gamma_dx,
+                          (f1 - f0) * beta_dy + (f2 - f0) * gamma_dy};
+    };
+
+    // screen space depth is already linear in screen space
+    st.planes[PLANE_Z] = make_plane(v[0].z(), v[1].z(), v[2].z());
+    if (shading == Shading::DepthOnly)
+        return st;
+
+    // perspective correction: attribute / w and 1 / w are the linear ones
+    float inv_w[] = {1.0f / v[0].w(), 1.0f / v[1].w(), 1.0f / v[2].w()};
+    st.planes[PLANE_INV_W] = make_plane(inv_w[0], inv_w[1], inv_w[2]);
+
+    auto set_planes = [&](Attributes attribute, int first, const auto& attr) {
+        if ((fragment_attributes & attribute) != attribute)
+            return;
+        for (int c = 0; c < attr[0].size(); ++c)
+            st.planes[first + c] = make_plane(attr[0][c] * inv_w[0], attr[1][c] * inv_w[1], attr[2][c] * inv_w[2]);
+    };
+    set_planes(Attributes::Color, PLANE_COLOR, color);
+    set_planes(Attributes::Normal, PLANE_NORMAL, normal);
+    set_planes(Attributes::TexCoords, PLANE_TEXCOORD, tex_coords);
+    set_planes(Attributes::ViewPos, PLANE_VIEW_POS, view_pos);
+
+    return st;
+}
+
+void rst::rasterizer::draw(std::vector<Triangle *> &TriangleList) {
+    draw(TriangleList, fragment_shader);
+}
+
+void rst::rasterizer::draw(vert_buf_id vert_buffer, ind_buf_id ind_buffer) {
+    draw(vert_buffer, ind_buffer, fragment_shader);
+}
+
+void rst::rasterizer::bin(vert_buf_id vert_buffer, ind_buf_id ind_buffer)
+{
+    bin_triangles(*vert_buf.at(vert_buffer.vert_id), *ind_buf.at(ind_buffer.ind_id));
+}
+
+void rst::rasterizer::draw(lod_buf_id lods) {
+    draw(lods, fragment_shader);
+}
+
+void rst::rasterizer::bin(lod_buf_id lods)
+{
+    const lod_level& level = lod_buf.at(lods.lod_id)->levels[select_lod(lods)];
+    bin(level.vertices, level.indices);
+}
+
+int rst::rasterizer::select_lod(lod_buf_id lods) const
+{
+    const lod_chain& chain = *lod_buf.at(lods.lod_id);
+    Eigen::Matrix4f view_model = view * model;
+    Eigen::Vector3f center = (view_model * chain.center.homogeneous()).head<3>();
+    float scale = view_model.block<3, 3>(0, 0).colwise().norm().maxCoeff();
+    float nearest = center.norm() - chain.radius * scale;
+    // the eye is inside the bounding sphere, where any error may be close up
+    if (nearest <= 0)
+        return 0;
+
+    // pixels a unit of model space length covers at the nearest point of the
+    // sphere, where the perspective magnifies the error the most
+    float pixels = scale * std::abs(projection(1, 1)) * height / 2 / nearest;
+    for (int level = (int)chain.levels.size() - 1; level > 0; --level)
+        if (chain.levels[level].error * pixels <= lod_tolerance)
+            return level;
+    return 0;
+}
+
+void rst::rasterizer::bin_triangles(std::vector<Triangle *> &TriangleList)
+{
+    // three vertices of their own per triangle; Triangle positions have w = 1
+    int count = 3 * (int)TriangleList.size();
+    int padded = (count + simd::WIDTH - 1) / simd::WIDTH * simd::WIDTH;
+    tri_vertices.count = count;
+    for (auto* a : {&tri_vertices.x, &tri_vertices.y, &tri_vertices.z, &tri_vertices.nx, &tri_vertices.ny,
+                    &tri_vertices.nz, &tri_vertices.u, &tri_vertices.v})
+        a->assign(padded, 0.0f);
+    tri_indices.resize(TriangleList.size());
+
+    for (int k = 0; k < (int)TriangleList.size(); ++k)
+    {
+        const Triangle& t = *TriangleList[k];
+        for (int j = 0; j < 3; ++j)
+        {
+            int i = 3 * k + j;
+            tri_vertices.x[i] = t.v[j].x();
+            tri_vertices.y[i] = t.v[j].y();
+            tri_vertices.z[i] = t.v[j].z();
+            tri_vertices.nx[i] = t.normal[j].x();
+            tri_vertices.ny[i] = t.normal[j].y();
+            tri_vertices.nz[i] = t.normal[j].z();
+            tri_vertices.u[i] = t.tex_coords[j].x();
+            tri_vertices.v[i] = t.tex_coords[j].y();
         }
+        tri_indices[k] = Eigen::Vector3i(3 * k, 3 * k + 1, 3 * k + 2);
+    }
 
-        newtri.setColor(0, 148,121.0,92.0);
-        newtri.setColor(1, 148,121.0,92.0);
-        newtri.setColor(2, 148,121.0,92.0);
+    bin_triangles(tri_vertices, tri_indices);
+}
 
-        // Also pass view space vertice position
-        rasterize_triangle(newtri, viewspace_pos);
+void rst::rasterizer::bin_triangles(const vertex_buffer& vb, const std::vector<Eigen::Vector3i>& indices)
+{
+    transform_vertices(vb);
+
+    int num_tris = (int)indices.size();
+    int num_tiles = tiles_x * tiles_y;
+
+    setup_tris.resize(num_tris);
+    if (shading == Shading::Deferred)
+        std::fill(vis_buf.begin(), vis_buf.end(), -1);
+    bins.resize(num_threads);
+    for (auto& worker_bins : bins) {
+        worker_bins.resize(num_tiles);
+        for (auto& bin : worker_bins)
+            bin.clear();
+    }
+    extra_tris.resize(num_threads);
+    for (auto& extra : extra_tris)
+        extra.clear();
+
+    // Phase 1: each worker assembles and sets up a contiguous range of
+    // triangles and bins them into its own per-tile lists
+    run_parallel(num_threads, [&](int worker) {
+        int begin = (int)((long long)num_tris * worker / num_threads);
+        int end = (int)((long long)num_tris * (worker + 1) / num_threads);
+        std::vector<setup_triangle>& extra = extra_tris[worker];
+        auto bin = [&](const setup_triangle& st, int id) {
+            for (int ty = st.min_y / TILE_SIZE; ty <= st.max_y / TILE_SIZE; ++ty)
+                for (int tx = st.min_x / TILE_SIZE; tx <= st.max_x / TILE_SIZE; ++tx)
+                    bins[worker][ty * tiles_x + tx].push_back(id);
+        };
+        for (int k = begin; k < end; ++k)
+        {
+            int first_extra = (int)extra.size();
+            int count = assemble(vb, indices[k], setup_tris[k], extra);
+            if (count == 0)
+                continue;
+            bin(setup_tris[k], k);
+            for (int e = first_extra; e < (int)extra.size(); ++e)
+                bin(extra[e], ~e);
+        }
+    });
+
+    // the extra triangles from clipping go after the submitted ones
+    extra_base.resize(num_threads);
+    for (int worker = 0; worker < num_threads; ++worker)
+    {
+        extra_base[worker] = (int)setup_tris.size();
+        setup_tris.insert(setup_tris.end(), extra_tris[worker].begin(), extra_tris[worker].end());
     }
 }
 
-static Eigen::Vector3f interpolate(float alpha, float beta, float gamma, const Eigen::Vector3f& vert1, const Eigen::Vector3f& vert2, const Eigen::Vector3f& vert3, float weight)
-{
-    return (alpha * vert1 + beta * vert2 + gamma * vert3) / weight;
-}
-
-static Eigen::Vector2f interpolate(float alpha, float beta, float gamma, const Eigen::Vector2f& vert1, const Eigen::Vector2f& vert2, const Eigen::Vector2f& vert3, float weight)
-{
-    auto u = (alpha * vert1[0] + beta * vert2[0] + gamma * vert3[0]);
-    auto v = (alpha * vert1[1] + beta * vert2[1] + gamma * vert3[1]);
-
-    u /= weight;
-    v /= weight;
-
-    return Eigen::Vector2f(u, v);
-}
-
-/**
- * Ļռդ - תΪ
- * 
- * @param t ҪդΣ㡢ɫϢ
- * @param view_pos ӿռеλã͸Уֵ
- * 
- * Ҫ裺
- * 1. εİΧУBounding Box
- * 2. Χڵÿ
- * 3. жǷڲ
- * 4. 겢͸Уֵ
- * 5. ִȲԣZ-Buffer㷨
- * 6. Ƭɫɫ
- */
-void rst::rasterizer::rasterize_triangle(const Triangle& t, const std::array<Eigen::Vector3f, 3>& view_pos)
-{
-    // ȡε꣨ѾMVP任ӿڱ任
-    auto v = t.toVector4();
-
-    // === 1Χб߽ ===
-    float max_x, min_x, max_y, min_y;
-
-    // X߽磺ҵXֵСֵ
-    max_x = v[0].x() > v[1].x() ? v[0].x() : v[1].x();
-    max_x = max_x > v[2].x() ? max_x : v[2].x();
-
-    min_x = v[0].x() < v[1].x() ? v[0].x() : v[1].x();
-    min_x = min_x < v[2].x() ? min_x : v[2].x();
-
-    // Y߽磺ҵYֵСֵ
-    max_y = v[0].y() > v[1].y() ? v[0].y() : v[1].y();
-    max_y = max_y > v[2].y() ? max_y : v[2].y();
-
-    min_y = v[0].y() < v[1].y() ? v[0].y() : v[1].y();
-    min_y = min_y < v[2].y() ? min_y : v[2].y();
-
-    // === 2Χڵÿ ===
-    for (int i = min_x; i < max_x; i++) {
-        for (int j = min_y; j < max_y; j++) {
-            
-            // === 3ڲ - жϵǰǷڲ ===
-            if (insideTriangle(i, j, t.v) == true) {
-                
-                // === 4͸Уֵ ===
-                // (i,j)ε
-                auto [alpha, beta, gamma] = computeBarycentric2D(i, j, t.v);
-                
-                // ͸Уֵȷֵ
-                // Zӿռʵȣ͸У
-                float Z = 1.0 / (alpha / v[0].w() + beta / v[1].w() + gamma / v[2].w());
-                
-                // zpĻռֵȲԣ
-                float zp = alpha * v[0].z() / v[0].w() + beta * v[1].z() / v[1].w() + gamma * v[2].z() / v[2].w();
-                zp *= Z; // Ӧ͸У
-                
-                // === 5ȲԣZ-Buffer㷨===
-                float index = get_index(i, j); // ȡȻе
-                
-                // ǰصСڵȻеֵͨȲ
-                if (zp <= this->depth_buf[index]) {
-                    
-                    // === 6Բֵ ===
-                    // ʹֵֶԣɫꡢ꣩
-                    auto interpolated_color = interpolate(alpha, beta, gamma, t.color[0], t.color[1], t.color[2], 1); 
-                    auto interpolated_normal = interpolate(alpha, beta, gamma, t.normal[0], t.normal[1], t.normal[2], 1); 
-                    auto interpolated_texcoords = interpolate(alpha, beta, gamma, t.tex_coords[0], t.tex_coords[1], t.tex_coords[2], 1); 
-                    auto interpolated_shadingcoords = interpolate(alpha, beta, gamma, view_pos[0], view_pos[1], view_pos[2], 1); 
-                    
-                    // Ȼ
-                    this->depth_buf[index] = zp;
-                    
-                    // === 7Ƭɫ ===
-                    // Ƭɫݽṹ
-                    fragment_shader_payload payload(interpolated_color, 
-                                                  interpolated_normal.normalized(), 
-                                                  interpolated_texcoords, 
-                                                  texture ? &*texture : nullptr);
-                    payload.view_pos = interpolated_shadingcoords;
-                    
-                    // Ƭɫյɫ
-                    auto pixel_color = fragment_shader(payload);
-                    
-                    // === 8д֡ ===
-                    // ɫд֡ʾĻ
-                    set_pixel(Eigen::Vector2i(i, j), pixel_color);
-                }
-            }
+int rst::rasterizer::attribute_planes(int planes[NUM_PLANES]) const
+{
+    int count = 0;
+    if (shading == Shading::DepthOnly)
+        return count;
+    auto use_planes = [&](Attributes attribute, int first, int n) {
+        if ((fragment_attributes & attribute) == attribute)
+            for (int c = 0; c < n; ++c)
+                planes[count++] = first + c;
+    };
+    planes[count++] = PLANE_INV_W;
+    use_planes(Attributes::Color, PLANE_COLOR, 3);
+    use_planes(Attributes::Normal, PLANE_NORMAL, 3);
+    use_planes(Attributes::TexCoords, PLANE_TEXCOORD, 2);
+    use_planes(Attributes::ViewPos, PLANE_VIEW_POS, 3);
+    return count;
+}
+
+void rst::rasterizer::tex_derivatives(const setup_triangle& st, int x, int y, const float* value,
+                                      Eigen::Vector2f& dx, Eigen::Vector2f& dy) const
+{
+    // (u / w, v / w, 1 / w) and their steps in x and y
+    const attr_plane& u = st.planes[PLANE_TEXCOORD];
+    const attr_plane& v = st.planes[PLANE_TEXCOORD + 1];
+    const attr_plane& inv_w = st.planes[PLANE_INV_W];
+    Eigen::Vector3f step_x(u.dx, v.dx, inv_w.dx), step_y(u.dy, v.dy, inv_w.dy);
+
+    // back to the quad's first pixel, then across to its neighbours in x and y
+    Eigen::Vector3f first = Eigen::Vector3f(value[PLANE_TEXCOORD], value[PLANE_TEXCOORD + 1], value[PLANE_INV_W]) -
+                            step_x * (x & 1) - step_y * (y & 1);
+    Eigen::Vector3f next_x = first + step_x, next_y = first + step_y;
+    Eigen::Vector2f uv = first.head<2>() / first.z();
+    dx = next_x.head<2>() / next_x.z() - uv;
+    dy = next_y.head<2>() / next_y.z() - uv;
+}
+
+fragment_packet rst::rasterizer::make_packet(const setup_triangle* const* tris, int x, int y,
+                                             const float (*value)[simd::WIDTH], int mask)
+{
+    auto needs = [&](Attributes a) { return (fragment_attributes & a) == a; };
+    // ͸У/w  1/w
+    simd::f32x8 w = simd::splat(1.0f) / simd::load(value[PLANE_INV_W]);
+    auto vec3 = [&](int first) {
+        return simd::vec3x8{simd::load(value[first]) * w, simd::load(value[first + 1]) * w, simd::load(value[first + 2]) * w};
+    };
+    simd::vec3x8 zero = simd::splat(0.0f, 0.0f, 0.0f);
+
+    fragment_packet packet;
+    packet.color = needs(Attributes::Color) ? vec3(PLANE_COLOR) : zero;
+    packet.normal = needs(Attributes::Normal) ? simd::normalized(vec3(PLANE_NORMAL)) : zero;
+    packet.view_pos = needs(Attributes::ViewPos) ? vec3(PLANE_VIEW_POS) : zero;
+    packet.tex_u = needs(Attributes::TexCoords) ? simd::load(value[PLANE_TEXCOORD]) * w : zero.x;
+    packet.tex_v = needs(Attributes::TexCoords) ? simd::load(value[PLANE_TEXCOORD + 1]) * w : zero.x;
+
+    float du_dx[simd::WIDTH] = {}, dv_dx[simd::WIDTH] = {}, du_dy[simd::WIDTH] = {}, dv_dy[simd::WIDTH] = {};
+    if (needs(Attributes::TexCoords)) {
+        for (int lane = 0; lane < simd::WIDTH; ++lane) {
+            if (!(mask >> lane & 1))
+                continue;
+            float lane_value[NUM_PLANES];
+            lane_value[PLANE_INV_W] = value[PLANE_INV_W][lane];
+            lane_value[PLANE_TEXCOORD] = value[PLANE_TEXCOORD][lane];
+            lane_value[PLANE_TEXCOORD + 1] = value[PLANE_TEXCOORD + 1][lane];
+            Eigen::Vector2f dx, dy;
+            tex_derivatives(*tris[lane], x + lane, y, lane_value, dx, dy);
+            du_dx[lane] = dx.x();
+            dv_dx[lane] = dx.y();
+            du_dy[lane] = dy.x();
+            dv_dy[lane] = dy.y();
         }
     }
+    packet.tex_du_dx = simd::load(du_dx);
+    packet.tex_dv_dx = simd::load(dv_dx);
+    packet.tex_du_dy = simd::load(du_dy);
+    packet.tex_dv_dy = simd::load(dv_dy);
+    packet.mask = mask;
+    packet.texture = texture.get();
+    packet.uniform_block = uniforms.get();
+    packet.uniform_type = uniforms_type;
+    return packet;
+}
+
+uint32_t rst::rasterizer::pack_bgra(const Eigen::Vector3f& color)
+{
+    auto channel = [](float c) { return (uint32_t)std::nearbyint(std::min(std::max(c, 0.0f), 255.0f)); };
+    return channel(color.z()) | channel(color.y()) << 8 | channel(color.x()) << 16 | 0xff000000u;
+}
+
+void rst::rasterizer::write_packet(int index, int mask, const simd::vec3x8& color)
+{
+    if (frame_format == FrameFormat::BGRA8) {
+        // same as pack_bgra, 8 lanes at a time
+        auto channel = [](simd::f32x8 c) {
+            return simd::to_int(simd::min(simd::max(c, simd::splat(0.0f)), simd::splat(255.0f)));
+        };
+        simd::i32x8 packed = channel(color.z) | channel(color.y) << 8 | channel(color.x) << 16 |
+                             simd::splat((int32_t)0xff000000u);
+        int32_t bgra[simd::WIDTH];
+        simd::store(bgra, packed);
+        for (int lane = 0; lane < simd::WIDTH; ++lane)
+            if (mask >> lane & 1)
+                frame_buf_bgra[index + lane] = (uint32_t)bgra[lane];
+        return;
+    }
+
+    float r[simd::WIDTH], g[simd::WIDTH], b[simd::WIDTH];
+    simd::store(r, color.x);
+    simd::store(g, color.y);
+    simd::store(b, color.z);
+    for (int lane = 0; lane < simd::WIDTH; ++lane)
+        if (mask >> lane & 1)
+            frame_buf[index + lane] = Eigen::Vector3f(r[lane], g[lane], b[lane]);
 }
 
 void rst::rasterizer::set_model(const Eigen::Matrix4f& m)
@@ -367,10 +911,13 @@ void rst::rasterizer::clear(rst::Buffers buff)
     if ((buff & rst::Buffers::Color) == rst::Buffers::Color)
     {
         std::fill(frame_buf.begin(), frame_buf.end(), Eigen::Vector3f{0, 0, 0});
+        std::fill(frame_buf_bgra.begin(), frame_buf_bgra.end(), pack_bgra(Eigen::Vector3f{0, 0, 0}));
     }
     if ((buff & rst::Buffers::Depth) == rst::Buffers::Depth)
     {
         std::fill(depth_buf.begin(), depth_buf.end(), std::numeric_limits<float>::infinity());
+        float inf = std::numeric_limits<float>::infinity();
+        std::fill(hiz.begin(), hiz.end(), depth_range{inf, inf});
     }
 }
 
@@ -378,20 +925,52 @@ rst::rasterizer::rasterizer(int w, int h) : width(w), height(h)
 {
     frame_buf.resize(w * h);
     depth_buf.resize(w * h);
+    vis_buf.resize(w * h);
+
+    tiles_x = (w + TILE_SIZE - 1) / TILE_SIZE;
+    tiles_y = (h + TILE_SIZE - 1) / TILE_SIZE;
+    blocks_x = (w + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    blocks_y = (h + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    hiz.resize(blocks_x * blocks_y);
+    num_threads = std::max(1u, std::thread::hardware_concurrency());
+}
+
+void rst::rasterizer::share_buffers(const rasterizer& other)
+{
+    pos_buf = other.pos_buf;
+    ind_buf = other.ind_buf;
+    col_buf = other.col_buf;
+    nor_buf = other.nor_buf;
+    vert_buf = other.vert_buf;
+    lod_buf = other.lod_buf;
+    normal_id = other.normal_id;
+    next_id = other.next_id;
+}
 
-    texture = std::nullopt;
+void rst::rasterizer::set_frame_format(FrameFormat format)
+{
+    frame_format = format;
+    frame_buf.assign(format == FrameFormat::RGB32F ? width * height : 0, Eigen::Vector3f{0, 0, 0});
+    frame_buf_bgra.assign(format == FrameFormat::BGRA8 ? width * height : 0, pack_bgra(Eigen::Vector3f{0, 0, 0}));
+}
+
+cv::Mat rst::rasterizer::frame_image()
+{
+    if (frame_format == FrameFormat::BGRA8)
+        return cv::Mat(height, width, CV_8UC4, frame_buf_bgra.data());
+    return cv::Mat(height, width, CV_32FC3, frame_buf.data());
 }
 
-int rst::rasterizer::get_index(int x, int y)
+int rst::rasterizer::get_index(int x, int y) const
 {
-    return (height-y)*width + x;
+    return (height-1-y)*width + x;
 }
 
 void rst::rasterizer::set_pixel(const Vector2i &point, const Eigen::Vector3f &color)
 {
     //old index: auto ind = point.y() + point.x() * width;
-    int ind = (height-point.y())*width + point.x();
-    frame_buf[ind] = color;
+    int ind = (height-1-point.y())*width + point.x();
+    write_pixel(ind, color);
 }
 
 void rst::rasterizer::set_vertex_shader(std::function<Eigen::Vector3f(vertex_shader_payload)> vert_shader)
@@ -399,8 +978,10 @@ void rst::rasterizer::set_vertex_shader(std::function<Eigen::Vector3f(vertex_sha
     vertex_shader = vert_shader;
 }
 
-void rst::rasterizer::set_fragment_shader(std::function<Eigen::Vector3f(fragment_shader_payload)> frag_shader)
+void rst::rasterizer::set_fragment_shader(std::function<Eigen::Vector3f(fragment_shader_payload)> frag_shader,
+                                          Attributes attributes)
 {
     fragment_shader = frag_shader;
+    fragment_attributes = attributes;
 }
 
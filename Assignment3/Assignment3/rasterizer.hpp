@@ -5,11 +5,20 @@
 #pragma once
 
 #include <Eigen/Dense>
-#include <optional>
+#include <array>
+#include <cstdint>
 #include <algorithm>
+#include <functional>
+#include <map>
+#include <memory>
+#include <atomic>
+#include <limits>
+#include <type_traits>
+#include <opencv2/core.hpp>
 #include "global.hpp"
 #include "Shader.hpp"
 #include "Triangle.hpp"
+#include "Simd.hpp"
 
 using namespace Eigen;
 
@@ -31,6 +40,64 @@ namespace rst
         return Buffers((int)a & (int)b);
     }
 
+    // Per-fragment attributes a fragment shader reads; only these are
+    // interpolated into its payload
+    enum class Attributes
+    {
+        Color = 1,
+        Normal = 2,
+        TexCoords = 4,
+        ViewPos = 8,
+        All = 15
+    };
+
+    inline Attributes operator|(Attributes a, Attributes b)
+    {
+        return Attributes((int)a | (int)b);
+    }
+
+    inline Attributes operator&(Attributes a, Attributes b)
+    {
+        return Attributes((int)a & (int)b);
+    }
+
+    // Forward shades every fragment that passes the depth test when it is
+    // rasterized. Deferred first rasterizes visibility only, then shades each
+    // visible pixel once, so shading cost no longer grows with overdraw.
+    // DepthOnly writes the depth buffer and nothing else: no attributes are
+    // set up and no shader is called. Drawn before a Forward pass of the same
+    // geometry it is a Z-prepass, which leaves that pass shading only the
+    // visible fragments; drawn from a light it renders a shadow map.
+    enum class Shading
+    {
+        Forward,
+        Deferred,
+        DepthOnly
+    };
+
+    // Back culls triangles wound clockwise on screen, which a closed mesh with
+    // counter-clockwise front faces only shows from behind
+    enum class Culling
+    {
+        None,
+        Back
+    };
+
+    // Layout of the color buffer. RGB32F keeps the shader output as is, three
+    // floats in [0, 255] per pixel. BGRA8 rounds and clamps it into one packed
+    // 32-bit pixel as it is written, the layout cv::imshow and cv::imwrite take,
+    // so frame_image() can be shown or saved without any conversion.
+    enum class FrameFormat
+    {
+        RGB32F,
+        BGRA8
+    };
+
+    // Whether a fragment shader takes a whole fragment_packet and returns a
+    // color per lane, rather than one fragment_shader_payload at a time
+    template <typename FragmentShader>
+    constexpr bool is_packet_shader = std::is_invocable_v<const FragmentShader&, const fragment_packet&>;
+
     enum class Primitive
     {
         Line,
@@ -57,6 +124,46 @@ namespace rst
         int col_id = 0;
     };
 
+    struct vert_buf_id
+    {
+        int vert_id = 0;
+    };
+
+    struct lod_buf_id
+    {
+        int lod_id = 0;
+    };
+
+    // One level of detail of a mesh for load_lods: its buffers, and how far,
+    // in model space, its surface may be from that of the finest level
+    struct lod_level
+    {
+        vert_buf_id vertices;
+        ind_buf_id indices;
+        float error = 0;
+    };
+
+    // Edge function E(x, y) = a * x + b * y + c evaluated at the center of pixel
+    // (x, y), in fixed point with 4 bits of subpixel precision. E >= 0 means the
+    // pixel is covered; c already holds the top-left fill rule bias, so a pixel on
+    // an edge shared by two triangles is drawn exactly once.
+    struct edge_eq
+    {
+        int32_t a, b;
+        int64_t c;
+
+        int64_t at(int x, int y) const { return (int64_t)a * x + (int64_t)b * y + c; }
+    };
+
+    // A value varying linearly in screen space, f(x, y) = c + dx * x + dy * y,
+    // with (x, y) measured in pixels from a per-triangle origin
+    struct attr_plane
+    {
+        float c, dx, dy;
+
+        float at(int x, int y) const { return c + dx * x + dy * y; }
+    };
+
     class rasterizer
     {
     public:
@@ -65,29 +172,235 @@ namespace rst
         ind_buf_id load_indices(const std::vector<Eigen::Vector3i>& indices);
         col_buf_id load_colors(const std::vector<Eigen::Vector3f>& colors);
         col_buf_id load_normals(const std::vector<Eigen::Vector3f>& normals);
+        // The vertices of an indexed mesh for draw(vert_buf_id, ind_buf_id): one
+        // entry per distinct vertex, shared by every triangle that indexes it
+        vert_buf_id load_vertices(const std::vector<Eigen::Vector3f>& positions,
+                                  const std::vector<Eigen::Vector3f>& normals,
+                                  const std::vector<Eigen::Vector2f>& tex_coords);
+        // Levels of detail of one mesh, finest first, already loaded with
+        // load_vertices and load_indices. draw(lod_buf_id) draws one of them.
+        lod_buf_id load_lods(const std::vector<lod_level>& levels);
+        // Gives this rasterizer every buffer loaded into other, under the same
+        // ids and without copying them, for rasterizers drawing the same
+        // meshes into targets of their own, such as shadow maps. Buffers
+        // loaded here before are dropped.
+        void share_buffers(const rasterizer& other);
 
         void set_model(const Eigen::Matrix4f& m);
         void set_view(const Eigen::Matrix4f& v);
         void set_projection(const Eigen::Matrix4f& p);
 
-        void set_texture(Texture tex) { texture = tex; }
+        void set_texture(Texture tex) { texture = std::make_shared<const Texture>(std::move(tex)); }
+        // Binds a block of constants, such as lights and material, for the
+        // fragment shaders of the following draws to read with
+        // payload.uniforms<T>() or packet.uniforms<T>(). The block is copied
+        // once here and every fragment gets a pointer to the copy.
+        template <typename T>
+        void set_uniforms(const T& block)
+        {
+            uniforms = std::make_shared<const T>(block);
+            uniforms_type = &typeid(T);
+        }
 
         void set_vertex_shader(std::function<Eigen::Vector3f(vertex_shader_payload)> vert_shader);
-        void set_fragment_shader(std::function<Eigen::Vector3f(fragment_shader_payload)> frag_shader);
+        // attributes: the payload fields frag_shader reads, the rest are left zero
+        void set_fragment_shader(std::function<Eigen::Vector3f(fragment_shader_payload)> frag_shader,
+                                 Attributes attributes = Attributes::All);
+
+        void set_shading(Shading mode) { shading = mode; }
+        // Worker threads per draw, one per hardware thread by default. Set it to 1
+        // for rasterizers that each run on a thread of their own.
+        void set_threads(int n) { num_threads = std::max(1, n); }
+        void set_culling(Culling mode) { culling = mode; }
+        // How many pixels the error of a level of detail may cover on screen
+        // for draw(lod_buf_id) to draw it, 1 by default
+        void set_lod_tolerance(float pixels) { lod_tolerance = pixels; }
+        // Reallocates the color buffer, which is left cleared to black
+        void set_frame_format(FrameFormat format);
 
         void set_pixel(const Vector2i &point, const Eigen::Vector3f &color);
 
         void clear(Buffers buff);
 
         void draw(pos_buf_id pos_buffer, ind_buf_id ind_buffer, col_buf_id col_buffer, Primitive type);
+        // Two phases: triangles are transformed and binned into TILE_SIZE x TILE_SIZE
+        // screen tiles in parallel, then each worker rasterizes whole tiles, so no two
+        // threads ever write the same pixel and no locks are needed.
+        // Shades with the std::function given to set_fragment_shader.
         void draw(std::vector<Triangle *> &TriangleList);
+        // Same, but calls shader(const fragment_shader_payload&) directly. Every
+        // shader type gets its own copy of the rasterization loop, so pass a
+        // function object rather than a function pointer to get the call inlined.
+        // Packet shaders, shader(const fragment_packet&) -> simd::vec3x8, are
+        // called once per row of up to 8 pixels instead.
+        // The attributes given to set_fragment_shader still apply.
+        template <typename FragmentShader>
+        void draw(std::vector<Triangle *> &TriangleList, const FragmentShader& shader);
+        // Draws the triangles of ind_buffer, indices into vert_buffer. Each vertex
+        // is transformed once per draw however many triangles share it, so prefer
+        // this to a TriangleList, which transforms three vertices per triangle.
+        void draw(vert_buf_id vert_buffer, ind_buf_id ind_buffer);
+        template <typename FragmentShader>
+        void draw(vert_buf_id vert_buffer, ind_buf_id ind_buffer, const FragmentShader& shader);
+        // The two phases of that draw on their own, so that a caller can run the
+        // phases of different frames at once, each frame in its own rasterizer:
+        // bin transforms and bins the triangles with the current matrices, and
+        // rasterize shades what the last bin left. Only clear may come between.
+        void bin(vert_buf_id vert_buffer, ind_buf_id ind_buffer);
+        // Draws the coarsest level of lods whose error, projected with the
+        // current matrices at the nearest point of the mesh's bounding sphere,
+        // stays within the LOD tolerance, so that a mesh far away or small on
+        // screen costs a fraction of its triangles. select_lod says which level
+        // that is; the Z-prepass and shaded pass of a frame pick the same one.
+        void draw(lod_buf_id lods);
+        template <typename FragmentShader>
+        void draw(lod_buf_id lods, const FragmentShader& shader);
+        void bin(lod_buf_id lods);
+        int select_lod(lod_buf_id lods) const;
+        // The buffers of one level of lods, to draw a chosen level regardless
+        // of the matrices
+        const lod_level& get_lod(lod_buf_id lods, int level) const { return lod_buf.at(lods.lod_id)->levels.at(level); }
+        template <typename FragmentShader>
+        void rasterize(const FragmentShader& shader) { rasterize_tiles(shader); }
 
+        // RGB32F only
         std::vector<Eigen::Vector3f>& frame_buffer() { return frame_buf; }
+        // A header over the color buffer, sharing its memory: CV_8UC4 for BGRA8,
+        // CV_32FC3 (in RGB order) for RGB32F. It stays valid until the next
+        // set_frame_format and sees every later draw.
+        cv::Mat frame_image();
+        // The depth draw left at pixel (x, y), infinity where it drew nothing
+        float get_depth(int x, int y) const { return depth_buf[get_index(x, y)]; }
+        // Where draw puts the clip space position clip: its pixel coordinates,
+        // its depth as get_depth holds it, and clip.w()
+        Eigen::Vector4f to_screen(const Eigen::Vector4f& clip) const;
 
     private:
         void draw_line(Eigen::Vector3f begin, Eigen::Vector3f end);
 
-        void rasterize_triangle(const Triangle& t, const std::array<Eigen::Vector3f, 3>& world_pos);
+        // indices into setup_triangle::planes; vertex attributes are stored
+        // divided by w so that they interpolate linearly in screen space
+        enum plane_index
+        {
+            PLANE_Z,
+            PLANE_INV_W,
+            PLANE_COLOR,
+            PLANE_NORMAL = PLANE_COLOR + 3,
+            PLANE_TEXCOORD = PLANE_NORMAL + 3,
+            PLANE_VIEW_POS = PLANE_TEXCOORD + 2,
+            NUM_PLANES = PLANE_VIEW_POS + 3
+        };
+
+        // Vertex attributes in SoA form, every array padded with zeros to a
+        // multiple of simd::WIDTH so the vertex pass has no scalar tail
+        struct vertex_buffer
+        {
+            int count = 0;
+            std::vector<float> x, y, z;
+            std::vector<float> nx, ny, nz;
+            std::vector<float> u, v;
+        };
+
+        // A mesh's levels of detail, and the bounding sphere of the finest in model space
+        struct lod_chain
+        {
+            std::vector<lod_level> levels;
+            Eigen::Vector3f center;
+            float radius;
+        };
+
+        // Post-transform vertex cache: the vertex pass output for every vertex of
+        // the current draw, laid out like vertex_buffer
+        struct vertex_cache
+        {
+            // screen space position; w keeps the clip space w
+            std::vector<float> x, y, z, w;
+            // clip space position (its w is w above) and the clip planes it is outside of
+            std::vector<float> cx, cy, cz;
+            std::vector<uint16_t> clip_code;
+            // view space position and normal
+            std::vector<float> vx, vy, vz;
+            std::vector<float> nx, ny, nz;
+        };
+
+        struct setup_triangle
+        {
+            // edge[k] vanishes on the edge opposite vertex k, so at a pixel
+            // edge[k].at(x, y) * inv_area is the barycentric weight of vertex k
+            std::array<edge_eq, 3> edge;
+            float inv_area;
+            // covered pixel range, inclusive and clamped to the screen;
+            // (min_x, min_y) is also the origin of the planes
+            int min_x, min_y, max_x, max_y;
+            // depth range of the vertices
+            float min_z, max_z;
+            bool visible;
+            // only the planes of fragment_attributes are set up
+            std::array<attr_plane, NUM_PLANES> planes;
+        };
+
+        // Transforms all of vb into vcache, 8 vertices at a time, with the
+        // matrices computed once per draw
+        void transform_vertices(const vertex_buffer& vb);
+        // Sets up the screen space triangle v (w keeping the clip space w) with
+        // the given per-vertex attributes
+        setup_triangle setup(const Eigen::Vector4f* v, const std::array<Eigen::Vector3f, 3>& view_pos,
+                             const std::array<Eigen::Vector3f, 3>& normal,
+                             const std::array<Eigen::Vector2f, 3>& tex_coords);
+        // Primitive assembly of triangle tri from vcache (and vb for the
+        // untransformed attributes): frustum and backface culling, then clipping
+        // against the near and far planes and the guard band. Stores the first
+        // resulting triangle in first and any others in extra; returns how many
+        // there are.
+        int assemble(const vertex_buffer& vb, const Eigen::Vector3i& tri, setup_triangle& first,
+                     std::vector<setup_triangle>& extra);
+        // Phase 1 of draw: fills vcache, setup_tris and bins. Triangles clipped into
+        // several go to the end of setup_tris and are binned as ~(index into
+        // extra_tris[worker]) until then.
+        void bin_triangles(const vertex_buffer& vb, const std::vector<Eigen::Vector3i>& indices);
+        // Same for a TriangleList, copied into tri_vertices and tri_indices first
+        void bin_triangles(std::vector<Triangle *> &TriangleList);
+        // Phases 2 and 3 of draw
+        template <typename FragmentShader>
+        void rasterize_tiles(const FragmentShader& shader);
+        // Runs job(worker) for worker in [0, num_threads), worker 0 on the calling
+        // thread and the others on a pool of threads kept across draws
+        static void run_parallel(int num_threads, const std::function<void(int)>& job);
+        // Rasterizes the part of st inside the pixel rect [x0, x1) x [y0, y1) in
+        // BLOCK_SIZE x BLOCK_SIZE blocks, one SIMD row of edge values at a time;
+        // id is st's index in setup_tris, recorded in vis_buf in deferred mode
+        template <typename FragmentShader>
+        void rasterize_triangle(const setup_triangle& st, int id, int x0, int y0, int x1, int y1,
+                                const FragmentShader& shader);
+        // Shades pixel (x, y) of st, whose interpolated planes, attribute / w
+        // and 1 / w, are value[plane]; only the planes of fragment_attributes are read
+        template <typename FragmentShader>
+        Eigen::Vector3f shade_fragment(const setup_triangle& st, int x, int y, const float* value,
+                                       const FragmentShader& shader);
+        // Packet version of shade_fragment's payload setup for the pixels
+        // (x + lane, y): value[plane][lane] holds the planes of the lanes in
+        // mask, tris[lane] the triangle they belong to
+        fragment_packet make_packet(const setup_triangle* const* tris, int x, int y,
+                                    const float (*value)[simd::WIDTH], int mask);
+        // Screen-space derivatives of the texture coordinates at pixel (x, y)
+        // of st, whose planes there are value: the differences across the
+        // pixel's 2x2 quad, as a GPU takes them, with the other pixels of the
+        // quad evaluated on the planes whether st covers them or not
+        void tex_derivatives(const setup_triangle& st, int x, int y, const float* value,
+                             Eigen::Vector2f& dx, Eigen::Vector2f& dy) const;
+        // The output merger: stores color at index of the color buffer, in frame_format
+        void write_pixel(int index, const Eigen::Vector3f& color)
+        {
+            if (frame_format == FrameFormat::BGRA8)
+                frame_buf_bgra[index] = pack_bgra(color);
+            else
+                frame_buf[index] = color;
+        }
+        static uint32_t pack_bgra(const Eigen::Vector3f& color);
+        // Writes the lanes in mask to the color buffer at index + lane
+        void write_packet(int index, int mask, const simd::vec3x8& color);
+        // Stores the plane indices fragment shading reads and returns their count
+        int attribute_planes(int planes[NUM_PLANES]) const;
 
         // VERTEX SHADER -> MVP -> Clipping -> /.W -> VIEWPORT -> DRAWLINE/DRAWTRI -> FRAGSHADER
 
@@ -98,23 +411,391 @@ namespace rst
 
         int normal_id = -1;
 
-        std::map<int, std::vector<Eigen::Vector3f>> pos_buf;
-        std::map<int, std::vector<Eigen::Vector3i>> ind_buf;
-        std::map<int, std::vector<Eigen::Vector3f>> col_buf;
-        std::map<int, std::vector<Eigen::Vector3f>> nor_buf;
+        // Loaded buffers, the texture and the uniform block never change once
+        // set, so they are held by shared_ptr<const>: a copy of the rasterizer
+        // shares them, and only gets its own frame buffers and per-draw state
+        std::map<int, std::shared_ptr<const std::vector<Eigen::Vector3f>>> pos_buf;
+        std::map<int, std::shared_ptr<const std::vector<Eigen::Vector3i>>> ind_buf;
+        std::map<int, std::shared_ptr<const std::vector<Eigen::Vector3f>>> col_buf;
+        std::map<int, std::shared_ptr<const std::vector<Eigen::Vector3f>>> nor_buf;
+        std::map<int, std::shared_ptr<const vertex_buffer>> vert_buf;
+        std::map<int, std::shared_ptr<const lod_chain>> lod_buf;
 
-        std::optional<Texture> texture;
+        std::shared_ptr<const Texture> texture;
+        std::shared_ptr<const void> uniforms;
+        const std::type_info* uniforms_type = nullptr;
 
         std::function<Eigen::Vector3f(fragment_shader_payload)> fragment_shader;
+        Attributes fragment_attributes = Attributes::All;
+        Shading shading = Shading::Forward;
+        Culling culling = Culling::None;
+        float lod_tolerance = 1.0f;
         std::function<Eigen::Vector3f(vertex_shader_payload)> vertex_shader;
 
+        // only the buffer of frame_format is allocated
+        FrameFormat frame_format = FrameFormat::RGB32F;
         std::vector<Eigen::Vector3f> frame_buf;
+        std::vector<uint32_t> frame_buf_bgra;
         std::vector<float> depth_buf;
-        int get_index(int x, int y);
+        int get_index(int x, int y) const;
+
+        // Hierarchical Z: the nearest and farthest depth of each BLOCK_SIZE x
+        // BLOCK_SIZE block of depth_buf. max_z may lag behind and overestimate,
+        // which keeps rejecting against it safe.
+        struct depth_range
+        {
+            float min_z, max_z;
+        };
+        std::vector<depth_range> hiz;
+        int blocks_x, blocks_y;
+
+        // deferred mode: index into setup_tris of the triangle visible at each
+        // pixel during the current draw, -1 where it drew nothing
+        std::vector<int> vis_buf;
 
         int width, height;
 
+        static constexpr int TILE_SIZE = 32;
+        static constexpr int BLOCK_SIZE = 8;
+        int tiles_x, tiles_y;
+        int num_threads;
+
+        // per-draw storage, kept between calls to avoid reallocating
+        vertex_cache vcache;
+        vertex_buffer tri_vertices;
+        std::vector<Eigen::Vector3i> tri_indices;
+        std::vector<setup_triangle> setup_tris;
+        // triangles beyond the first a worker's clipping produced, and where
+        // they start in setup_tris once phase 1 is done
+        std::vector<std::vector<setup_triangle>> extra_tris;
+        std::vector<int> extra_base;
+        // bins[worker][tile]: indices into setup_tris, in submission order
+        std::vector<std::vector<std::vector<int>>> bins;
+
         int next_id = 0;
         int get_next_id() { return next_id++; }
     };
 }
+
+// Template members of rst::rasterizer: everything that calls the fragment
+// shader, so that each shader type gets its own instantiation of the
+// rasterization loop with the shader call inlined.
+
+template <typename FragmentShader>
+void rst::rasterizer::draw(std::vector<Triangle *> &TriangleList, const FragmentShader& shader)
+{
+    // Phase 1: set up and bin the triangles into tiles
+    bin_triangles(TriangleList);
+    rasterize_tiles(shader);
+}
+
+template <typename FragmentShader>
+void rst::rasterizer::draw(vert_buf_id vert_buffer, ind_buf_id ind_buffer, const FragmentShader& shader)
+{
+    // Phase 1: transform the vertices, then set up and bin the triangles into tiles
+    bin_triangles(*vert_buf.at(vert_buffer.vert_id), *ind_buf.at(ind_buffer.ind_id));
+    rasterize_tiles(shader);
+}
+
+template <typename FragmentShader>
+void rst::rasterizer::draw(lod_buf_id lods, const FragmentShader& shader)
+{
+    const lod_level& level = lod_buf.at(lods.lod_id)->levels[select_lod(lods)];
+    draw(level.vertices, level.indices, shader);
+}
+
+template <typename FragmentShader>
+void rst::rasterizer::rasterize_tiles(const FragmentShader& shader)
+{
+    int num_tiles = tiles_x * tiles_y;
+
+    // Phase 2: workers take whole tiles and rasterize every triangle binned to
+    // them; visiting the bins in worker order keeps the submission order
+    std::atomic<int> next_tile(0);
+    run_parallel(num_threads, [&](int) {
+        for (int tile = next_tile++; tile < num_tiles; tile = next_tile++)
+        {
+            int x0 = (tile % tiles_x) * TILE_SIZE;
+            int y0 = (tile / tiles_x) * TILE_SIZE;
+            int x1 = std::min(x0 + TILE_SIZE, width);
+            int y1 = std::min(y0 + TILE_SIZE, height);
+            for (int worker = 0; worker < num_threads; ++worker)
+                for (int k : bins[worker][tile])
+                {
+                    int id = k >= 0 ? k : extra_base[worker] + ~k;
+                    rasterize_triangle(setup_tris[id], id, x0, y0, x1, y1, shader);
+                }
+        }
+    });
+
+    if (shading != Shading::Deferred)
+        return;
+
+    // Phase 3 (deferred): shade each pixel once, from the planes of the
+    // triangle left visible there
+    int row_planes[NUM_PLANES];
+    int num_row_planes = attribute_planes(row_planes);
+    std::atomic<int> next_resolve(0);
+    run_parallel(num_threads, [&](int) {
+        for (int tile = next_resolve++; tile < num_tiles; tile = next_resolve++)
+        {
+            int x0 = (tile % tiles_x) * TILE_SIZE;
+            int y0 = (tile / tiles_x) * TILE_SIZE;
+            int x1 = std::min(x0 + TILE_SIZE, width);
+            for (int y = y0; y < std::min(y0 + TILE_SIZE, height); ++y)
+            {
+                if constexpr (is_packet_shader<FragmentShader>)
+                {
+                    // packets of up to 8 neighbouring pixels, whatever triangle each shows
+                    for (int x = x0; x < x1; x += BLOCK_SIZE)
+                    {
+                        int index = get_index(x, y);
+                        float value[NUM_PLANES][BLOCK_SIZE] = {};
+                        const setup_triangle* tris[BLOCK_SIZE] = {};
+                        int mask = 0;
+                        for (int lane = 0; lane < std::min(BLOCK_SIZE, x1 - x); ++lane)
+                        {
+                            if (vis_buf[index + lane] < 0)
+                                continue;
+                            const setup_triangle& st = setup_tris[vis_buf[index + lane]];
+                            for (int p = 0; p < num_row_planes; ++p)
+                                value[row_planes[p]][lane] = st.planes[row_planes[p]].at(x + lane - st.min_x, y - st.min_y);
+                            tris[lane] = &st;
+                            mask |= 1 << lane;
+                        }
+                        if (mask)
+                            write_packet(index, mask, shader(make_packet(tris, x, y, value, mask)));
+                    }
+                }
+                else
+                {
+                    for (int x = x0; x < x1; ++x)
+                    {
+                        int index = get_index(x, y);
+                        if (vis_buf[index] < 0)
+                            continue;
+                        const setup_triangle& st = setup_tris[vis_buf[index]];
+                        float value[NUM_PLANES];
+                        for (int p = 0; p < num_row_planes; ++p)
+                            value[row_planes[p]] = st.planes[row_planes[p]].at(x - st.min_x, y - st.min_y);
+                        write_pixel(index, shade_fragment(st, x, y, value, shader));
+                    }
+                }
+            }
+        }
+    });
+}
+
+template <typename FragmentShader>
+Eigen::Vector3f rst::rasterizer::shade_fragment(const setup_triangle& st, int x, int y, const float* value,
+                                                const FragmentShader& shader)
+{
+    auto needs = [&](Attributes a) { return (fragment_attributes & a) == a; };
+    // ͸У/w  1/w
+    float w = 1.0f / value[PLANE_INV_W];
+    auto vec3 = [&](int first) -> Eigen::Vector3f {
+        return Eigen::Vector3f(value[first], value[first + 1], value[first + 2]) * w;
+    };
+
+    // ƬɫݽṹɫҪΪ0
+    fragment_shader_payload payload(
+            needs(Attributes::Color) ? vec3(PLANE_COLOR) : Eigen::Vector3f(0, 0, 0),
+            needs(Attributes::Normal) ? vec3(PLANE_NORMAL).normalized() : Eigen::Vector3f(0, 0, 0),
+            needs(Attributes::TexCoords) ? Eigen::Vector2f(value[PLANE_TEXCOORD] * w, value[PLANE_TEXCOORD + 1] * w)
+                                         : Eigen::Vector2f(0, 0),
+            texture.get());
+    payload.uniform_block = uniforms.get();
+    payload.uniform_type = uniforms_type;
+    payload.view_pos = needs(Attributes::ViewPos) ? vec3(PLANE_VIEW_POS) : Eigen::Vector3f(0, 0, 0);
+    payload.tex_dx = payload.tex_dy = Eigen::Vector2f(0, 0);
+    if (needs(Attributes::TexCoords))
+        tex_derivatives(st, x, y, value, payload.tex_dx, payload.tex_dy);
+
+    // Ƭɫյɫ
+    return shader(payload);
+}
+
+/**
+ * Ļռդ - תΪ
+ * 
+ * @param st ҪդΣߺƽ桢ӿռλõȣsetupм㣩
+ * @param id stsetup_trisе±꣨ӳɫʱдɼԻ
+ * @param shader Ƭɫ
+ * @param x0, y0, x1, y1 ǰtileطΧ [x0, x1) x [y0, y1)
+ * 
+ * Ҫ裺
+ * 1. ΰΧtileĽ
+ * 2. 8x8ÿĸǶ߷ࣺȫĿֱ
+ *    ȫڵĿ鲻ڲԣֻвָǵĿSIMDߺ
+ * 3. ÿȷΧHi-Z޳ڵĲ֣ƽ
+ *    õȣִȲԣZ-Buffer㷨
+ * 4. ֻͨȲԵмɫҪƽ棬͸У
+ * 5. Ƭɫɫӳɫʱֻ¼±꣬ɫdrawĵ׶Σ
+ */
+template <typename FragmentShader>
+void rst::rasterizer::rasterize_triangle(const setup_triangle& st, int id, int x0, int y0, int x1, int y1,
+                                         const FragmentShader& shader)
+{
+    const auto& planes = st.planes;
+    const bool deferred = shading == Shading::Deferred;
+    const bool depth_only = shading == Shading::DepthOnly;
+
+    // planes stepped across a block row
+    int row_planes[NUM_PLANES];
+    int num_row_planes = attribute_planes(row_planes);
+
+    // === 1ΧtileĽҡϱ߽粻===
+    int xs = std::max(st.min_x, x0), xe = std::min(st.max_x + 1, x1);
+    int ys = std::max(st.min_y, y0), ye = std::min(st.max_y + 1, y1);
+
+    // === 2 ===
+    // blocks are aligned to the screen, so a block row is one SIMD register wide
+    static_assert(BLOCK_SIZE == simd::WIDTH, "one block row per SIMD register");
+    const int last = BLOCK_SIZE - 1;
+    for (int by = ys & ~last; by < ye; by += BLOCK_SIZE) {
+        for (int bx = xs & ~last; bx < xe; bx += BLOCK_SIZE) {
+
+            // Edge functions are linear, so the four corner pixels decide a
+            // block: all corners outside one edge rejects it, all corners
+            // inside every edge accepts it without any per-pixel test.
+            int partial = 0;
+            bool outside = false;
+            for (int k = 0; k < 3 && !outside; ++k) {
+                const edge_eq& e = st.edge[k];
+                int64_t c00 = e.at(bx, by);
+                int64_t c10 = c00 + (int64_t)e.a * last;
+                int64_t c01 = c00 + (int64_t)e.b * last;
+                int64_t c11 = c10 + (int64_t)e.b * last;
+                int negative = (c00 < 0) + (c10 < 0) + (c01 < 0) + (c11 < 0);
+                outside = negative == 4;
+                partial |= (negative != 0) << k;
+            }
+            if (outside)
+                continue;
+
+            // Hi-Z: the triangle's depth over the block lies between the depth
+            // plane's extremes at the block corners. Nearer than everything
+            // stored skips the per-pixel test, farther than everything stored
+            // rejects the whole block.
+            const attr_plane& zplane = planes[PLANE_Z];
+            float z00 = zplane.at(bx - st.min_x, by - st.min_y);
+            float zdx = zplane.dx * last, zdy = zplane.dy * last;
+            float tri_min_z = std::max(st.min_z, z00 + std::min(zdx, 0.0f) + std::min(zdy, 0.0f));
+            float tri_max_z = std::min(st.max_z, z00 + std::max(zdx, 0.0f) + std::max(zdy, 0.0f));
+            depth_range& range = hiz[(by / BLOCK_SIZE) * blocks_x + bx / BLOCK_SIZE];
+            if (tri_min_z > range.max_z)
+                continue;
+            const bool depth_passes = tri_max_z <= range.min_z;
+
+            int lane_begin = std::max(bx, xs) - bx;
+            int lane_end = std::min(bx + BLOCK_SIZE, xe) - bx;
+            int lanes = ((1 << lane_end) - 1) & ~((1 << lane_begin) - 1);
+
+            int row_begin = std::max(by, ys), row_end = std::min(by + BLOCK_SIZE, ye);
+            const bool full_block = !partial && lanes == 0xff && row_begin == by && row_end == by + BLOCK_SIZE;
+            bool wrote_depth = false;
+            int64_t row[3];
+            for (int k = 0; k < 3; ++k)
+                row[k] = st.edge[k].at(bx, row_begin);
+
+            for (int j = row_begin; j < row_end; ++j) {
+                // === 3ڲԣһ8 ===
+                // only edges crossing the block are tested; their values
+                // stay small there, so they step in 32 bits
+                int mask = lanes;
+                if (partial) {
+                    simd::i32x8 e = simd::splat(0);
+                    for (int k = 0; k < 3; ++k)
+                        if (partial >> k & 1)
+                            e = e | simd::ramp((int32_t)row[k], st.edge[k].a);
+                    mask &= ~simd::sign_mask(e);
+                }
+                for (int k = 0; k < 3; ++k)
+                    row[k] += st.edge[k].b;
+                if (!mask)
+                    continue;
+
+                // plane coordinates of the row's first pixel
+                int px = bx - st.min_x, py = j - st.min_y;
+
+                // === 4ȲԣZ-Buffer㷨===
+                // ǰصСڵȻеֵͨȲ
+                simd::f32x8 z = simd::ramp(planes[PLANE_Z].at(px, py), planes[PLANE_Z].dx);
+                int row_index = get_index(bx, j);
+                if (!depth_passes)
+                    mask &= ~simd::less_mask(simd::load(&depth_buf[row_index], mask), z);
+                if (!mask)
+                    continue;
+
+                if (depth_only) {
+                    // ֻдȣһд룬Hi-Z  min_z ڿʱ
+                    simd::store(&depth_buf[row_index], z, mask);
+                    wrote_depth = true;
+                    continue;
+                }
+                float zp[BLOCK_SIZE];
+                simd::store(zp, z);
+
+                if (deferred) {
+                    // visibility only: remember the nearest triangle, shade it later
+                    for (int lane = 0; lane < BLOCK_SIZE; ++lane) {
+                        if (!(mask >> lane & 1))
+                            continue;
+                        depth_buf[row_index + lane] = zp[lane];
+                        range.min_z = std::min(range.min_z, zp[lane]);
+                        vis_buf[row_index + lane] = id;
+                    }
+                    continue;
+                }
+
+                // === 5Բֵ͸У===
+                float attr[NUM_PLANES][BLOCK_SIZE];
+                for (int p = 0; p < num_row_planes; ++p) {
+                    const attr_plane& plane = planes[row_planes[p]];
+                    simd::store(attr[row_planes[p]], simd::ramp(plane.at(px, py), plane.dx));
+                }
+
+                // Ȼ
+                for (int lane = 0; lane < BLOCK_SIZE; ++lane) {
+                    if (!(mask >> lane & 1))
+                        continue;
+                    depth_buf[row_index + lane] = zp[lane];
+                    range.min_z = std::min(range.min_z, zp[lane]);
+                }
+
+                // === 6Ƭɫд֡ ===
+                if constexpr (is_packet_shader<FragmentShader>) {
+                    // the row is already in SoA form: one call for all 8 lanes
+                    const setup_triangle* tris[BLOCK_SIZE];
+                    std::fill(tris, tris + BLOCK_SIZE, &st);
+                    write_packet(row_index, mask, shader(make_packet(tris, bx, j, attr, mask)));
+                } else {
+                    for (int lane = 0; lane < BLOCK_SIZE; ++lane) {
+                        if (!(mask >> lane & 1))
+                            continue;
+                        float value[NUM_PLANES];
+                        for (int p = 0; p < num_row_planes; ++p)
+                            value[row_planes[p]] = attr[row_planes[p]][lane];
+                        write_pixel(row_index + lane, shade_fragment(st, bx + lane, j, value, shader));
+                    }
+                }
+            }
+
+            // the triangle's lower bound over the block, rather than the exact
+            // minimum of what was written, still bounds the block from below
+            if (wrote_depth)
+                range.min_z = std::min(range.min_z, tri_min_z);
+
+            // depths only ever decrease, so max_z stays a valid bound; it is
+            // tightened only when the triangle covered the whole block
+            if (full_block) {
+                range.max_z = -std::numeric_limits<float>::infinity();
+                for (int j = by; j < by + BLOCK_SIZE; ++j) {
+                    const float* depth = &depth_buf[get_index(bx, j)];
+                    for (int lane = 0; lane < BLOCK_SIZE; ++lane)
+                        range.max_z = std::max(range.max_z, depth[lane]);
+                }
+            }
+        }
+    }
+}
@@ -1,18 +1,42 @@
 #include <algorithm>
 #include <cassert>
+#include <thread>
 #include "BVH.hpp"
 
+// Ranges smaller than this are built on the thread that reaches them
+static constexpr int PARALLEL_BUILD_MIN = 4096;
+
+static std::vector<BVHPrimitiveInfo> makePrimitiveInfo(const std::vector<Object*>& objects)
+{
+    std::vector<BVHPrimitiveInfo> info(objects.size());
+    for (size_t i = 0; i < objects.size(); ++i) {
+        Bounds3 bounds = objects[i]->getBounds();
+        info[i] = { objects[i], { PrimType::Object, (uint32_t)i }, bounds,
+                    bounds.Centroid(), objects[i]->getArea() };
+    }
+    return info;
+}
+
 BVHAccel::BVHAccel(std::vector<Object*> p, int maxPrimsInNode,
                    SplitMethod splitMethod)
-    : maxPrimsInNode(std::min(255, maxPrimsInNode)), splitMethod(splitMethod),
-      primitives(std::move(p))
+    : BVHAccel(makePrimitiveInfo(p), maxPrimsInNode, splitMethod)
+{
+    primitives = std::move(p);
+}
+
+BVHAccel::BVHAccel(std::vector<BVHPrimitiveInfo> info, int maxPrimsInNode,
+                   SplitMethod splitMethod)
+    : maxPrimsInNode(std::min(255, maxPrimsInNode)), splitMethod(splitMethod)
 {
     time_t start, stop;
     time(&start);
-    if (primitives.empty())
+    if (info.empty())
         return;
 
-    root = recursiveBuild(primitives);
+    totalNodes = 2 * (int)info.size() - 1;
+    nodes.reset(new BVHBuildNode[totalNodes]);
+    int threads = (int)std::max(1u, std::thread::hardware_concurrency());
+    root = recursiveBuild(info.data(), (int)info.size(), nodes.get(), threads);
 
     time(&stop);
     double diff = difftime(stop, start);
@@ -25,26 +49,31 @@ BVHAccel::BVHAccel(std::vector<Object*> p, int maxPrimsInNode,
         hrs, mins, secs);
 }
 
-BVHBuildNode* BVHAccel::recursiveBuild(std::vector<Object*> objects)
+BVHAccel::~BVHAccel() = default;
+
+// Builds the subtree over info[0, count), reordering that range in place,
+// into the 2 * count - 1 nodes starting at node: the root, then the left
+// subtree, then the right. Since every subtree knows where its nodes go, the
+// two halves of a large range are built on separate threads, with up to
+// `threads` of them working on this subtree at once.
+BVHBuildNode* BVHAccel::recursiveBuild(BVHPrimitiveInfo* info, int count,
+                                       BVHBuildNode* node, int threads)
 {
-    BVHBuildNode* node = new BVHBuildNode();
+    assert(node + 2 * count - 1 <= nodes.get() + totalNodes);
 
-    // Compute bounds of all primitives in BVH node
-    Bounds3 bounds;
-    for (int i = 0; i < objects.size(); ++i)
-        bounds = Union(bounds, objects[i]->getBounds());
-    if (objects.size() == 1) {
+    if (count == 1) {
         // Create leaf _BVHBuildNode_
-        node->bounds = objects[0]->getBounds();
-        node->object = objects[0];
+        node->bounds = info[0].bounds;
+        node->object = info[0].object;
+        node->prim = info[0].prim;
         node->left = nullptr;
         node->right = nullptr;
-        node->area = objects[0]->getArea();
+        node->area = info[0].area;
         return node;
     }
-    else if (objects.size() == 2) {
-        node->left = recursiveBuild(std::vector{objects[0]});
-        node->right = recursiveBuild(std::vector{objects[1]});
+    else if (count == 2) {
+        node->left = recursiveBuild(info, 1, node + 1, 1);
+        node->right = recursiveBuild(info + 1, 1, node + 2, 1);
 
         node->bounds = Union(node->left->bounds, node->right->bounds);
         node->area = node->left->area + node->right->area;
@@ -52,42 +81,29 @@ BVHBuildNode* BVHAccel::recursiveBuild(std::vector<Object*> objects)
     }
     else {
         Bounds3 centroidBounds;
-        for (int i = 0; i < objects.size(); ++i)
-            centroidBounds =
-                Union(centroidBounds, objects[i]->getBounds().Centroid());
+        for (int i = 0; i < count; ++i)
+            centroidBounds = Union(centroidBounds, info[i].centroid);
         int dim = centroidBounds.maxExtent();
-        switch (dim) {
-        case 0:
-            std::sort(objects.begin(), objects.end(), [](auto f1, auto f2) {
-                return f1->getBounds().Centroid().x <
-                       f2->getBounds().Centroid().x;
-            });
-            break;
-        case 1:
-            std::sort(objects.begin(), objects.end(), [](auto f1, auto f2) {
-                return f1->getBounds().Centroid().y <
-                       f2->getBounds().Centroid().y;
-            });
-            break;
-        case 2:
-            std::sort(objects.begin(), objects.end(), [](auto f1, auto f2) {
-                return f1->getBounds().Centroid().z <
-                       f2->getBounds().Centroid().z;
-            });
-            break;
-        }
-
-        auto beginning = objects.begin();
-        auto middling = objects.begin() + (objects.size() / 2);
-        auto ending = objects.end();
-
-        auto leftshapes = std::vector<Object*>(beginning, middling);
-        auto rightshapes = std::vector<Object*>(middling, ending);
-
-        assert(objects.size() == (leftshapes.size() + rightshapes.size()));
 
-        node->left = recursiveBuild(leftshapes);
-        node->right = recursiveBuild(rightshapes);
+        // Only the median split is needed, not a full sort
+        int mid = count / 2;
+        std::nth_element(info, info + mid, info + count,
+                         [dim](const BVHPrimitiveInfo& a, const BVHPrimitiveInfo& b) {
+                             return a.centroid[dim] < b.centroid[dim];
+                         });
+
+        node->splitAxis = dim;
+        BVHBuildNode* left = node + 1;
+        BVHBuildNode* right = node + 2 * mid;
+        if (threads > 1 && count >= PARALLEL_BUILD_MIN) {
+            std::thread worker([=]() { recursiveBuild(info, mid, left, threads / 2); });
+            node->right = recursiveBuild(info + mid, count - mid, right, threads - threads / 2);
+            worker.join();
+            node->left = left;
+        } else {
+            node->left = recursiveBuild(info, mid, left, 1);
+            node->right = recursiveBuild(info + mid, count - mid, right, 1);
+        }
 
         node->bounds = Union(node->left->bounds, node->right->bounds);
         node->area = node->left->area + node->right->area;
@@ -96,30 +112,11 @@ BVHBuildNode* BVHAccel::recursiveBuild(std::vector<Object*> objects)
     return node;
 }
 
-Intersection BVHAccel::Intersect(const Ray& ray) const
-{
-    Intersection isect;
-    if (!root)
-        return isect;
-    isect = BVHAccel::getIntersection(root, ray);
-    return isect;
-}
-
-Intersection BVHAccel::getIntersection(BVHBuildNode* node, const Ray& ray) const
+bool BVHAccel::Intersect(const Ray& ray, Hit& hit) const
 {
-    // TODO Traverse the BVH to find intersection
-    std::array<int, 3> dirisNeg = { int(ray.direction.x > 0),int(ray.direction.y > 0),int(ray.direction.z > 0) };
-    Intersection inter;
-    if (node->bounds.IntersectP(ray, Vector3f(1.0f / ray.direction.x, 1.0f / ray.direction.y, 1.0f / ray.direction.z), dirisNeg) == false)
-        return Intersection();
-    if (node->left == nullptr && node->right == nullptr)
-        return node->object->getIntersection(ray);
-    Intersection hit1;
-    Intersection hit2;
-    hit1 = getIntersection(node->left, ray);
-    hit2 = getIntersection(node->right, ray);
-
-    return (hit1.distance < hit2.distance) ? hit1 : hit2;
+    return Intersect(ray, hit, [](const BVHBuildNode* node, const Ray& r, Hit& h) {
+        return node->object->intersect(r, h);
+    });
 }
 
 
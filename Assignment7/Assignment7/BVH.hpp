@@ -16,8 +16,27 @@
 #include "Vector.hpp"
 
 struct BVHBuildNode;
+
+// Identifies a leaf primitive by its concrete type and its index in the
+// owner's array of that type, so traversal can call a non-virtual kernel.
+// PrimType::Object marks primitives only reachable through Object*.
+enum class PrimType : uint32_t { Object, Triangle, Sphere };
+
+struct PrimRef
+{
+    PrimType type = PrimType::Object;
+    uint32_t index = 0;
+};
+
 // BVHAccel Forward Declarations
-struct BVHPrimitiveInfo;
+struct BVHPrimitiveInfo
+{
+    Object* object;
+    PrimRef prim;
+    Bounds3 bounds;
+    Vector3f centroid;
+    float area;
+};
 
 // BVHAccel Declarations
 inline int leafNodes, totalLeafNodes, totalPrimitives, interiorNodes;
@@ -29,27 +48,43 @@ public:
 
     // BVHAccel Public Methods
     BVHAccel(std::vector<Object*> p, int maxPrimsInNode = 1, SplitMethod splitMethod = SplitMethod::NAIVE);
+    BVHAccel(std::vector<BVHPrimitiveInfo> info, int maxPrimsInNode = 1, SplitMethod splitMethod = SplitMethod::NAIVE);
     Bounds3 WorldBound() const;
     ~BVHAccel();
 
-    Intersection Intersect(const Ray &ray) const;
-    Intersection getIntersection(BVHBuildNode* node, const Ray& ray)const;
+    // Returns true if `hit` was replaced by a closer hit in this BVH. Leaves
+    // are tested through the virtual Object::intersect.
+    bool Intersect(const Ray &ray, Hit &hit) const;
+    // Same, with leaves tested by leafTest(node, ray, hit). Lets the owner of
+    // the primitive arrays dispatch on node->prim without virtual calls.
+    template <typename LeafTest>
+    bool Intersect(const Ray &ray, Hit &hit, LeafTest&& leafTest) const;
+    template <typename LeafTest>
+    bool getIntersection(const BVHBuildNode* node, const Ray& ray, const std::array<int, 3>& dirIsNeg, Hit& hit, LeafTest& leafTest) const;
     bool IntersectP(const Ray &ray) const;
-    BVHBuildNode* root;
+    BVHBuildNode* root = nullptr;
 
     // BVHAccel Private Methods
-    BVHBuildNode* recursiveBuild(std::vector<Object*>objects);
+    BVHBuildNode* recursiveBuild(BVHPrimitiveInfo* info, int count,
+                                 BVHBuildNode* node, int threads);
 
     // BVHAccel Private Data
     const int maxPrimsInNode;
     const SplitMethod splitMethod;
     std::vector<Object*> primitives;
 
+    // All nodes live in one cache-line-aligned block sized for a full binary
+    // tree over the primitives (2n - 1 nodes), laid out depth first so that
+    // every subtree fills a range of its own, and freed together with the
+    // BVHAccel.
+    std::unique_ptr<BVHBuildNode[]> nodes;
+    int totalNodes = 0;
+
     void getSample(BVHBuildNode* node, float p, Intersection &pos, float &pdf);
     void Sample(Intersection &pos, float &pdf);
 };
 
-struct BVHBuildNode {
+struct alignas(64) BVHBuildNode {
     Bounds3 bounds;
     BVHBuildNode *left;
     BVHBuildNode *right;
@@ -57,7 +92,8 @@ struct BVHBuildNode {
     float area;
 
 public:
-    int splitAxis=0, firstPrimOffset=0, nPrimitives=0;
+    int splitAxis=0;
+    PrimRef prim;
     // BVHBuildNode Public Methods
     BVHBuildNode(){
         bounds = Bounds3();
@@ -65,6 +101,29 @@ public:
         object = nullptr;
     }
 };
+static_assert(sizeof(BVHBuildNode) == 64, "BVHBuildNode should fill exactly one cache line");
+
+template <typename LeafTest>
+bool BVHAccel::Intersect(const Ray& ray, Hit& hit, LeafTest&& leafTest) const
+{
+    if (!root)
+        return false;
+    std::array<int, 3> dirIsNeg = { int(ray.direction.x > 0),int(ray.direction.y > 0),int(ray.direction.z > 0) };
+    return getIntersection(root, ray, dirIsNeg, hit, leafTest);
+}
+
+template <typename LeafTest>
+bool BVHAccel::getIntersection(const BVHBuildNode* node, const Ray& ray, const std::array<int, 3>& dirIsNeg, Hit& hit, LeafTest& leafTest) const
+{
+    if (node->bounds.IntersectP(ray, ray.direction_inv, dirIsNeg) == false)
+        return false;
+    if (node->left == nullptr && node->right == nullptr)
+        return leafTest(node, ray, hit);
+    bool hit1 = getIntersection(node->left, ray, dirIsNeg, hit, leafTest);
+    bool hit2 = getIntersection(node->right, ray, dirIsNeg, hit, leafTest);
+
+    return hit1 || hit2;
+}
 
 
 
@@ -4,6 +4,7 @@
 
 #ifndef RAYTRACING_INTERSECTION_H
 #define RAYTRACING_INTERSECTION_H
+#include <limits>
 #include "Vector.hpp"
 #include "Material.hpp"
 class Object;
@@ -28,4 +29,26 @@ struct Intersection
     Object* obj;
     Material* m;
 };
+
+// Compact record carried through BVH traversal: ray distance, barycentrics
+// and the leaf primitive that was hit. The full surface data is only built
+// for the closest hit, see Object::getSurfaceInteraction.
+struct Hit
+{
+    float t = std::numeric_limits<float>::max();
+    float u = 0, v = 0;
+    Object* obj = nullptr;
+};
+
+struct SurfaceInteraction
+{
+    bool happened = false;
+    Vector3f coords;
+    Vector3f normal;
+    ShadingFrame frame;
+    Vector3f emit;
+    double distance = std::numeric_limits<double>::max();
+    Object* obj = nullptr;
+    Material* m = nullptr;
+};
 #endif //RAYTRACING_INTERSECTION_H
@@ -9,6 +9,32 @@
 
 enum MaterialType { DIFFUSE};
 
+// Orthonormal basis (B, C, N) around a surface normal, used to take
+// directions sampled in local space to world space.
+struct ShadingFrame
+{
+    Vector3f B, C, N;
+
+    ShadingFrame() {}
+    ShadingFrame(const Vector3f &n) : N(n)
+    {
+        if (std::fabs(N.x) > std::fabs(N.y)){
+            float invLen = 1.0f / std::sqrt(N.x * N.x + N.z * N.z);
+            C = Vector3f(N.z * invLen, 0.0f, -N.x *invLen);
+        }
+        else {
+            float invLen = 1.0f / std::sqrt(N.y * N.y + N.z * N.z);
+            C = Vector3f(0.0f, N.z * invLen, -N.y *invLen);
+        }
+        B = crossProduct(C, N);
+    }
+
+    Vector3f toWorld(const Vector3f &a) const
+    {
+        return a.x * B + a.y * C + a.z * N;
+    }
+};
+
 class Material{
 private:
 
@@ -72,17 +98,7 @@ private:
     }
 
     Vector3f toWorld(const Vector3f &a, const Vector3f &N){
-        Vector3f B, C;
-        if (std::fabs(N.x) > std::fabs(N.y)){
-            float invLen = 1.0f / std::sqrt(N.x * N.x + N.z * N.z);
-            C = Vector3f(N.z * invLen, 0.0f, -N.x *invLen);
-        }
-        else {
-            float invLen = 1.0f / std::sqrt(N.y * N.y + N.z * N.z);
-            C = Vector3f(0.0f, N.z * invLen, -N.y *invLen);
-        }
-        B = crossProduct(C, N);
-        return a.x * B + a.y * C + a.z * N;
+        return ShadingFrame(N).toWorld(a);
     }
 
 public:
@@ -103,6 +119,8 @@ public:
 
     // sample a ray by Material properties
     inline Vector3f sample(const Vector3f &wi, const Vector3f &N);
+    // same as above, reusing a frame built once per hit
+    inline Vector3f sample(const Vector3f &wi, const ShadingFrame &frame);
     // given a ray, calculate the PdF of this ray
     inline float pdf(const Vector3f &wi, const Vector3f &wo, const Vector3f &N);
     // given a ray, calculate the contribution of this ray
@@ -130,6 +148,10 @@ Vector3f Material::getColorAt(double u, double v) {
 
 
 Vector3f Material::sample(const Vector3f &wi, const Vector3f &N){
+    return sample(wi, ShadingFrame(N));
+}
+
+Vector3f Material::sample(const Vector3f &wi, const ShadingFrame &frame){
     switch(m_type){
         case DIFFUSE:
         {
@@ -138,7 +160,7 @@ Vector3f Material::sample(const Vector3f &wi, const Vector3f &N){
             float z = std::fabs(1.0f - 2.0f * x_1);
             float r = std::sqrt(1.0f - z * z), phi = 2 * M_PI * x_2;
             Vector3f localRay(r*std::cos(phi), r*std::sin(phi), z);
-            return toWorld(localRay, N);
+            return frame.toWorld(localRay);
             
             break;
         }
@@ -18,11 +18,14 @@ public:
     virtual ~Object() {}
     virtual bool intersect(const Ray& ray) = 0;
     virtual bool intersect(const Ray& ray, float &, uint32_t &) const = 0;
-    virtual Intersection getIntersection(Ray _ray) = 0;
+    // Updates `hit` if the ray hits this object closer than hit.t.
+    virtual bool intersect(const Ray& ray, Hit& hit) = 0;
+    virtual SurfaceInteraction getSurfaceInteraction(const Ray& ray, const Hit& hit) = 0;
     virtual void getSurfaceProperties(const Vector3f &, const Vector3f &, const uint32_t &, const Vector2f &, Vector3f &, Vector2f &) const = 0;
     virtual Vector3f evalDiffuseColor(const Vector2f &) const =0;
     virtual Bounds3 getBounds()=0;
     virtual float getArea()=0;
+    virtual float getEmitArea()=0;
     virtual void Sample(Intersection &pos, float &pdf)=0;
     virtual bool hasEmit()=0;
 };
@@ -2,38 +2,151 @@
 // Created by Göksu Güvendiren on 2019-05-14.
 //
 
+#include <atomic>
+#include <thread>
 #include "Scene.hpp"
+#include "Triangle.hpp"
+#include "Sphere.hpp"
 
+struct Scene::PrimitiveStore
+{
+    // triangles are referenced where they live, mostly inside their meshes,
+    // rather than copied
+    std::vector<Triangle*> triangles;
+    std::vector<Sphere> spheres;
+    // any other Object type, reached through virtual calls
+    std::vector<Object*> objects;
+
+    // emissive primitives and their running area sum for light sampling
+    std::vector<PrimRef> lights;
+    std::vector<float> light_cdf;
+    float light_area = 0;
+
+    Object* get(PrimRef prim)
+    {
+        switch (prim.type) {
+            case PrimType::Triangle: return triangles[prim.index];
+            case PrimType::Sphere: return &spheres[prim.index];
+            default: return objects[prim.index];
+        }
+    }
+
+    bool intersect(PrimRef prim, const Ray& ray, Hit& hit)
+    {
+        switch (prim.type) {
+            case PrimType::Triangle: return triangles[prim.index]->Triangle::intersect(ray, hit);
+            case PrimType::Sphere: return spheres[prim.index].Sphere::intersect(ray, hit);
+            default: return objects[prim.index]->intersect(ray, hit);
+        }
+    }
+
+    void sample(PrimRef prim, Intersection& pos, float& pdf)
+    {
+        switch (prim.type) {
+            case PrimType::Triangle: {
+                Triangle& tri = *triangles[prim.index];
+                tri.Triangle::Sample(pos, pdf);
+                pos.emit = tri.m->getEmission();
+                break;
+            }
+            case PrimType::Sphere: spheres[prim.index].Sphere::Sample(pos, pdf); break;
+            default: objects[prim.index]->Sample(pos, pdf); break;
+        }
+    }
+};
+
+Scene::Scene(int w, int h) : width(w), height(h)
+{}
+
+Scene::~Scene() = default;
 
 void Scene::buildBVH() {
     printf(" - Generating BVH...\n\n");
-    this->bvh = new BVHAccel(objects, 1, BVHAccel::SplitMethod::NAIVE);
+    prims.reset(new PrimitiveStore());
+    for (auto object : objects) {
+        if (auto mesh = dynamic_cast<MeshTriangle*>(object))
+            for (auto& tri : mesh->triangles)
+                prims->triangles.push_back(&tri);
+        else if (auto tri = dynamic_cast<Triangle*>(object))
+            prims->triangles.push_back(tri);
+        else if (auto sphere = dynamic_cast<Sphere*>(object))
+            prims->spheres.push_back(*sphere);
+        else
+            prims->objects.push_back(object);
+    }
+
+    std::vector<BVHPrimitiveInfo> info;
+    info.reserve(prims->triangles.size() + prims->spheres.size() + prims->objects.size());
+    auto add = [&](PrimType type, size_t count) {
+        for (uint32_t i = 0; i < count; ++i) {
+            PrimRef prim{ type, i };
+            Object* object = prims->get(prim);
+            Bounds3 bounds = object->getBounds();
+            info.push_back({ object, prim, bounds, bounds.Centroid(), object->getArea() });
+            if (object->hasEmit()) {
+                prims->light_area += object->getEmitArea();
+                prims->lights.push_back(prim);
+                prims->light_cdf.push_back(prims->light_area);
+            }
+        }
+    };
+    add(PrimType::Triangle, prims->triangles.size());
+    add(PrimType::Sphere, prims->spheres.size());
+    add(PrimType::Object, prims->objects.size());
+
+    this->bvh.reset(new BVHAccel(std::move(info), 1, BVHAccel::SplitMethod::NAIVE));
+}
+
+void Scene::LoadMeshes(const std::vector<MeshAsset>& assets)
+{
+    std::vector<std::unique_ptr<Object>> loaded(assets.size());
+    std::atomic<size_t> next(0);
+    auto worker = [&]() {
+        for (size_t i = next++; i < assets.size(); i = next++)
+            loaded[i] = std::make_unique<MeshTriangle>(assets[i].filename, assets[i].material);
+    };
+
+    size_t numThreads = std::min<size_t>(std::max(1u, std::thread::hardware_concurrency()), assets.size());
+    std::vector<std::thread> pool;
+    for (size_t t = 1; t < numThreads; ++t)
+        pool.emplace_back(worker);
+    worker();
+    for (auto& t : pool)
+        t.join();
+
+    for (auto& object : loaded) {
+        Add(object.get());
+        owned_objects.push_back(std::move(object));
+    }
+    buildBVH();
+}
+
+Hit Scene::closestHit(const Ray &ray) const
+{
+    Hit hit;
+    PrimitiveStore* store = prims.get();
+    this->bvh->Intersect(ray, hit, [store](const BVHBuildNode* node, const Ray& r, Hit& h) {
+        return store->intersect(node->prim, r, h);
+    });
+    return hit;
 }
 
-Intersection Scene::intersect(const Ray &ray) const
+SurfaceInteraction Scene::intersect(const Ray &ray) const
 {
-    return this->bvh->Intersect(ray);
+    Hit hit = closestHit(ray);
+    if (!hit.obj)
+        return SurfaceInteraction();
+    return hit.obj->getSurfaceInteraction(ray, hit);
 }
 
 void Scene::sampleLight(Intersection &pos, float &pdf) const
 {
-    float emit_area_sum = 0;
-    for (uint32_t k = 0; k < objects.size(); ++k) {
-        if (objects[k]->hasEmit()){
-            emit_area_sum += objects[k]->getArea();
-        }
-    }
-    float p = get_random_float() * emit_area_sum;
-    emit_area_sum = 0;
-    for (uint32_t k = 0; k < objects.size(); ++k) {
-        if (objects[k]->hasEmit()){
-            emit_area_sum += objects[k]->getArea();
-            if (p <= emit_area_sum){
-                objects[k]->Sample(pos, pdf);
-                break;
-            }
-        }
-    }
+    if (prims->lights.empty())
+        return;
+    float p = get_random_float() * prims->light_area;
+    size_t k = std::lower_bound(prims->light_cdf.begin(), prims->light_cdf.end(), p) - prims->light_cdf.begin();
+    prims->sample(prims->lights[std::min(k, prims->lights.size() - 1)], pos, pdf);
+    pdf = 1.0f / prims->light_area;
 }
 
 bool Scene::trace(
@@ -66,7 +179,7 @@ bool Scene::trace(
  Vector3f Scene::castRay(const Ray& ray, int depth) const
  {
      // Find the intersection point between the ray and scene objects
-     Intersection intersection = intersect(ray);
+     SurfaceInteraction intersection = intersect(ray);
      Vector3f hitcolor = Vector3f(1);  // Initialize color to black
 
      // Case 1: Ray directly hits a light source
@@ -94,7 +207,10 @@ bool Scene::trace(
          Vector3f L_dir = Vector3f(0);
 
          // Shadow test: Check if the light sample is visible from the hit point
-         if ((intersect(Ray(p, ws)).coords - x).norm() < 0.01)
+         // (only the hit distance is needed, so no surface data is built)
+         Ray shadowRay(p, ws);
+         Hit shadowHit = closestHit(shadowRay);
+         if (shadowHit.obj && (shadowRay(shadowHit.t) - x).norm() < 0.01)
          {
              // Calculate direct lighting contribution using the rendering equation:
              // L_dir = Le * BRDF * cos(θ_out) * cos(θ_in) / (distance² * pdf_light)
@@ -113,7 +229,7 @@ bool Scene::trace(
          // Russian Roulette: Probabilistically continue path tracing to avoid infinite recursion
          if (P_RR < Scene::RussianRoulette)
          {
-             Vector3f wi = intersection.m->sample(wo, N);    // Sample new incident direction using BRDF importance sampling
+             Vector3f wi = intersection.m->sample(wo, intersection.frame);    // Sample new incident direction using BRDF importance sampling
 
              // Recursively calculate indirect lighting contribution:
              // L_indir = L_incoming * BRDF * cos(θ) / (BRDF_pdf * RussianRoulette_probability)
@@ -5,6 +5,7 @@
 #pragma once
 
 #include <vector>
+#include <string>
 #include "Vector.hpp"
 #include "Object.hpp"
 #include "Light.hpp"
@@ -12,6 +13,13 @@
 #include "BVH.hpp"
 #include "Ray.hpp"
 
+// An OBJ file to load into the scene. A null material keeps the materials
+// from the file's MTL.
+struct MeshAsset
+{
+    std::string filename;
+    Material* material = nullptr;
+};
 
 class Scene
 {
@@ -24,16 +32,26 @@ public:
     int maxDepth = 1;
     float RussianRoulette = 0.8;
 
-    Scene(int w, int h) : width(w), height(h)
-    {}
+    Scene(int w, int h);
+    ~Scene();
 
     void Add(Object *object) { objects.push_back(object); }
     void Add(std::unique_ptr<Light> light) { lights.push_back(std::move(light)); }
 
+    // Loads the meshes concurrently (each file's parse is one task), adds
+    // them in the given order and builds the scene's BVH over all of their
+    // triangles once the last one is ready, itself on several threads. The
+    // scene owns the loaded meshes.
+    void LoadMeshes(const std::vector<MeshAsset>& assets);
+
     const std::vector<Object*>& get_objects() const { return objects; }
     const std::vector<std::unique_ptr<Light> >&  get_lights() const { return lights; }
-    Intersection intersect(const Ray& ray) const;
-    BVHAccel *bvh;
+    SurfaceInteraction intersect(const Ray& ray) const;
+    Hit closestHit(const Ray& ray) const;
+    std::unique_ptr<BVHAccel> bvh;
+    // Flattens the objects into per-type primitive arrays (meshes are split
+    // into their triangles, which stay in the mesh and are only referenced)
+    // and builds one BVH over all of them.
     void buildBVH();
     Vector3f castRay(const Ray &ray, int depth) const;
     void sampleLight(Intersection &pos, float &pdf) const;
@@ -46,6 +64,11 @@ public:
     // creating the scene (adding objects and lights)
     std::vector<Object* > objects;
     std::vector<std::unique_ptr<Light> > lights;
+    std::vector<std::unique_ptr<Object> > owned_objects;
+
+    // Per-type primitive storage built by buildBVH, see Scene.cpp
+    struct PrimitiveStore;
+    std::unique_ptr<PrimitiveStore> prims;
 
     // Compute reflection direction
     Vector3f reflect(const Vector3f &I, const Vector3f &N) const
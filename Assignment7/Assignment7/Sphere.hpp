@@ -46,26 +46,30 @@ public:
 
         return true;
     }
-    Intersection getIntersection(Ray ray){
-        Intersection result;
-        result.happened = false;
+    bool intersect(const Ray& ray, Hit& hit){
         Vector3f L = ray.origin - center;
         float a = dotProduct(ray.direction, ray.direction);
         float b = 2 * dotProduct(ray.direction, L);
         float c = dotProduct(L, L) - radius2;
         float t0, t1;
-        if (!solveQuadratic(a, b, c, t0, t1)) return result;
+        if (!solveQuadratic(a, b, c, t0, t1)) return false;
         if (t0 < 0) t0 = t1;
-        if (t0 < 0) return result;
-        result.happened=true;
-
-        result.coords = Vector3f(ray.origin + ray.direction * t0);
+        if (t0 < 0 || t0 >= hit.t) return false;
+        hit.t = t0;
+        hit.obj = this;
+        return true;
+    }
+    SurfaceInteraction getSurfaceInteraction(const Ray& ray, const Hit& hit){
+        SurfaceInteraction result;
+        result.happened = true;
+        result.coords = Vector3f(ray.origin + ray.direction * hit.t);
         result.normal = normalize(Vector3f(result.coords - center));
+        result.frame = ShadingFrame(result.normal);
+        result.emit = m->getEmission();
         result.m = this->m;
         result.obj = this;
-        result.distance = t0;
+        result.distance = hit.t;
         return result;
-
     }
     void getSurfaceProperties(const Vector3f &P, const Vector3f &I, const uint32_t &index, const Vector2f &uv, Vector3f &N, Vector2f &st) const
     { N = normalize(P - center); }
@@ -88,6 +92,9 @@ public:
     float getArea(){
         return area;
     }
+    float getEmitArea(){
+        return hasEmit() ? area : 0;
+    }
     bool hasEmit(){
         return m->hasEmission();
     }
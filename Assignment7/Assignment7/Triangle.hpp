@@ -8,8 +8,9 @@
 #include "Triangle.hpp"
 #include <cassert>
 #include <array>
+#include <mutex>
 
-bool rayTriangleIntersect(const Vector3f& v0, const Vector3f& v1,
+inline bool rayTriangleIntersect(const Vector3f& v0, const Vector3f& v1,
                           const Vector3f& v2, const Vector3f& orig,
                           const Vector3f& dir, float& tnear, float& u, float& v)
 {
@@ -61,7 +62,8 @@ public:
     bool intersect(const Ray& ray) override;
     bool intersect(const Ray& ray, float& tnear,
                    uint32_t& index) const override;
-    Intersection getIntersection(Ray ray) override;
+    bool intersect(const Ray& ray, Hit& hit) override;
+    SurfaceInteraction getSurfaceInteraction(const Ray& ray, const Hit& hit) override;
     void getSurfaceProperties(const Vector3f& P, const Vector3f& I,
                               const uint32_t& index, const Vector2f& uv,
                               Vector3f& N, Vector2f& st) const override
@@ -81,6 +83,9 @@ public:
     float getArea(){
         return area;
     }
+    float getEmitArea(){
+        return hasEmit() ? area : 0;
+    }
     bool hasEmit(){
         return m->hasEmission();
     }
@@ -89,14 +94,19 @@ public:
 class MeshTriangle : public Object
 {
 public:
-    MeshTriangle(const std::string& filename, Material *mt = new Material())
+    // Loads every group of an OBJ file into one mesh behind a single BVH.
+    // Each group takes its material from the MTL file unless `mt` is given,
+    // in which case `mt` is used for the whole file. The BVH is only built
+    // the first time the mesh itself is intersected: a Scene splits meshes
+    // into their triangles and never needs it.
+    MeshTriangle(const std::string& filename, Material *mt = nullptr)
     {
         objl::Loader loader;
         loader.LoadFile(filename);
         area = 0;
+        emit_area = 0;
         m = mt;
-        assert(loader.LoadedMeshes.size() == 1);
-        auto mesh = loader.LoadedMeshes[0];
+        assert(!loader.LoadedMeshes.empty());
 
         Vector3f min_vert = Vector3f{std::numeric_limits<float>::infinity(),
                                      std::numeric_limits<float>::infinity(),
@@ -104,35 +114,46 @@ public:
         Vector3f max_vert = Vector3f{-std::numeric_limits<float>::infinity(),
                                      -std::numeric_limits<float>::infinity(),
                                      -std::numeric_limits<float>::infinity()};
-        for (int i = 0; i < mesh.Vertices.size(); i += 3) {
-            std::array<Vector3f, 3> face_vertices;
-
-            for (int j = 0; j < 3; j++) {
-                auto vert = Vector3f(mesh.Vertices[i + j].Position.X,
-                                     mesh.Vertices[i + j].Position.Y,
-                                     mesh.Vertices[i + j].Position.Z);
-                face_vertices[j] = vert;
-
-                min_vert = Vector3f(std::min(min_vert.x, vert.x),
-                                    std::min(min_vert.y, vert.y),
-                                    std::min(min_vert.z, vert.z));
-                max_vert = Vector3f(std::max(max_vert.x, vert.x),
-                                    std::max(max_vert.y, vert.y),
-                                    std::max(max_vert.z, vert.z));
+        size_t numIndices = 0;
+        for (auto& mesh : loader.LoadedMeshes)
+            numIndices += mesh.Indices.size();
+        triangles.reserve(numIndices / 3);
+
+        for (auto& mesh : loader.LoadedMeshes) {
+            Material* mesh_m = mt ? mt : loadMaterial(mesh.MeshMaterial);
+            for (size_t i = 0; i + 2 < mesh.Indices.size(); i += 3) {
+                std::array<Vector3f, 3> face_vertices;
+
+                for (int j = 0; j < 3; j++) {
+                    auto& pos = mesh.Vertices[mesh.Indices[i + j]].Position;
+                    auto vert = Vector3f(pos.X, pos.Y, pos.Z);
+                    face_vertices[j] = vert;
+
+                    min_vert = Vector3f(std::min(min_vert.x, vert.x),
+                                        std::min(min_vert.y, vert.y),
+                                        std::min(min_vert.z, vert.z));
+                    max_vert = Vector3f(std::max(max_vert.x, vert.x),
+                                        std::max(max_vert.y, vert.y),
+                                        std::max(max_vert.z, vert.z));
+                }
+
+                triangles.emplace_back(face_vertices[0], face_vertices[1],
+                                       face_vertices[2], mesh_m);
             }
-
-            triangles.emplace_back(face_vertices[0], face_vertices[1],
-                                   face_vertices[2], mt);
         }
 
         bounding_box = Bounds3(min_vert, max_vert);
 
-        std::vector<Object*> ptrs;
         for (auto& tri : triangles){
-            ptrs.push_back(&tri);
             area += tri.area;
+            if (tri.m->hasEmission()) {
+                emit_area += tri.area;
+                emit_triangles.push_back(&tri);
+                emit_cdf.push_back(emit_area);
+            }
         }
-        bvh = new BVHAccel(ptrs);
+        if (m == nullptr)
+            m = triangles.empty() ? nullptr : triangles[0].m;
     }
 
     bool intersect(const Ray& ray) { return true; }
@@ -184,26 +205,40 @@ public:
                     Vector3f(0.937, 0.937, 0.231), pattern);
     }
 
-    Intersection getIntersection(Ray ray)
+    bool intersect(const Ray& ray, Hit& hit)
     {
-        Intersection intersec;
-
-        if (bvh) {
-            intersec = bvh->Intersect(ray);
-        }
+        std::call_once(bvh_built, [this]() {
+            std::vector<Object*> ptrs;
+            for (auto& tri : triangles)
+                ptrs.push_back(&tri);
+            bvh.reset(new BVHAccel(ptrs));
+        });
+        return bvh->Intersect(ray, hit);
+    }
 
-        return intersec;
+    // hit.obj is always one of the triangles, never the mesh itself
+    SurfaceInteraction getSurfaceInteraction(const Ray& ray, const Hit& hit)
+    {
+        return hit.obj->getSurfaceInteraction(ray, hit);
     }
     
+    // Samples a point on the emissive triangles only, uniformly by area.
     void Sample(Intersection &pos, float &pdf){
-        bvh->Sample(pos, pdf);
-        pos.emit = m->getEmission();
+        float p = get_random_float() * emit_area;
+        auto k = std::lower_bound(emit_cdf.begin(), emit_cdf.end(), p) - emit_cdf.begin();
+        Triangle* tri = emit_triangles[std::min<size_t>(k, emit_triangles.size() - 1)];
+        tri->Sample(pos, pdf);
+        pos.emit = tri->m->getEmission();
+        pdf = 1.0f / emit_area;
     }
     float getArea(){
         return area;
     }
+    float getEmitArea(){
+        return emit_area;
+    }
     bool hasEmit(){
-        return m->hasEmission();
+        return emit_area > 0;
     }
 
     Bounds3 bounding_box;
@@ -214,10 +249,43 @@ public:
 
     std::vector<Triangle> triangles;
 
-    BVHAccel* bvh;
+    std::unique_ptr<BVHAccel> bvh;
+    std::once_flag bvh_built;
     float area;
 
+    // Triangles with an emissive material and their running area sum,
+    // used to pick light samples proportionally to area.
+    std::vector<Triangle*> emit_triangles;
+    std::vector<float> emit_cdf;
+    float emit_area;
+
     Material* m;
+    std::vector<std::unique_ptr<Material>> materials;
+
+private:
+    // Returns the mesh-owned Material for an MTL entry, creating it on first
+    // use. Groups without a material share a default diffuse one.
+    Material* loadMaterial(const std::optional<objl::Material>& mtl)
+    {
+        std::string name = mtl ? mtl->name : "";
+        for (size_t k = 0; k < material_names.size(); ++k)
+            if (material_names[k] == name)
+                return materials[k].get();
+
+        auto mat = new Material();
+        if (mtl) {
+            mat->m_emission = Vector3f(mtl->Ke.X, mtl->Ke.Y, mtl->Ke.Z);
+            mat->Kd = Vector3f(mtl->Kd.X, mtl->Kd.Y, mtl->Kd.Z);
+            mat->Ks = Vector3f(mtl->Ks.X, mtl->Ks.Y, mtl->Ks.Z);
+            mat->specularExponent = mtl->Ns;
+            mat->ior = mtl->Ni;
+        }
+        materials.emplace_back(mat);
+        material_names.push_back(name);
+        return mat;
+    }
+
+    std::vector<std::string> material_names;
 };
 
 inline bool Triangle::intersect(const Ray& ray) { return true; }
@@ -229,48 +297,45 @@ inline bool Triangle::intersect(const Ray& ray, float& tnear,
 
 inline Bounds3 Triangle::getBounds() { return Union(Bounds3(v0, v1), v2); }
 
-inline Intersection Triangle::getIntersection(Ray ray)
+inline bool Triangle::intersect(const Ray& ray, Hit& hit)
 {
-    Intersection inter;
-
     if (dotProduct(ray.direction, normal) > 0)
-        return inter;
+        return false;
     double u, v, t_tmp = 0;
     Vector3f pvec = crossProduct(ray.direction, e2);
     double det = dotProduct(e1, pvec);
     if (fabs(det) < EPSILON)
-        return inter;
+        return false;
 
     double det_inv = 1. / det;
     Vector3f tvec = ray.origin - v0;
     u = dotProduct(tvec, pvec) * det_inv;
-    if (u < 0 || u > 1)
-        return inter;
+    if (u <= 0 || u > 1)
+        return false;
     Vector3f qvec = crossProduct(tvec, e1);
     v = dotProduct(ray.direction, qvec) * det_inv;
-    if (v < 0 || u + v > 1)
-        return inter;
+    if (v <= 0 || u + v >= 1)
+        return false;
     t_tmp = dotProduct(e2, qvec) * det_inv;
+    if (t_tmp <= 0 || t_tmp >= hit.t)
+        return false;
+
+    hit.t = t_tmp;
+    hit.u = u;
+    hit.v = v;
+    hit.obj = this;
+    return true;
+}
 
-    // TODO find ray triangle intersection
-    // TODO find ray triangle intersection
-    /*
-        bool happened;
-        Vector3f coords;
-        Vector3f normal;
-        double distance;
-        Object* obj;
-        Material* m;
-    */
-    //if(t_tmp < 0) return inter;
-    inter.happened = t_tmp > 0 && u>0 && v>0 && (1-u-v>0);
-    inter.coords = ray(t_tmp);//
+inline SurfaceInteraction Triangle::getSurfaceInteraction(const Ray& ray, const Hit& hit)
+{
+    SurfaceInteraction inter;
+    inter.happened = true;
+    inter.coords = ray(hit.t);
     inter.emit = m->getEmission();
-    //Vector3f tt = t0,t1,t2;
-    //inter.tcoords = tt;
     inter.normal = normal;
-    //inter.distance = distance(Vector3f(v0,v1,v2),ray.origin);
-    inter.distance = t_tmp;//
+    inter.frame = ShadingFrame(normal);
+    inter.distance = hit.t;
     inter.obj = this;
     inter.m = m;
 
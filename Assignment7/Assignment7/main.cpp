@@ -1,6 +1,5 @@
 #include "Renderer.hpp"
 #include "Scene.hpp"
-#include "Triangle.hpp"
 #include "Sphere.hpp"
 #include "Vector.hpp"
 #include "global.hpp"
@@ -25,21 +24,14 @@ int main(int argc, char** argv)
     Material* light = new Material(DIFFUSE, (8.0f * Vector3f(0.747f+0.058f, 0.747f+0.258f, 0.747f) + 15.6f * Vector3f(0.740f+0.287f,0.740f+0.160f,0.740f) + 18.4f *Vector3f(0.737f+0.642f,0.737f+0.159f,0.737f)));
     light->Kd = Vector3f(0.65f);
 
-    MeshTriangle floor("models/cornellbox/floor.obj", white);
-    MeshTriangle shortbox("models/cornellbox/shortbox.obj", white);
-    MeshTriangle tallbox("models/cornellbox/tallbox.obj", white);
-    MeshTriangle left("models/cornellbox/left.obj", red);
-    MeshTriangle right("models/cornellbox/right.obj", green);
-    MeshTriangle light_("models/cornellbox/light.obj", light);
-
-    scene.Add(&floor);
-    scene.Add(&shortbox);
-    scene.Add(&tallbox);
-    scene.Add(&left);
-    scene.Add(&right);
-    scene.Add(&light_);
-
-    scene.buildBVH();
+    scene.LoadMeshes({
+        {"models/cornellbox/floor.obj", white},
+        {"models/cornellbox/shortbox.obj", white},
+        {"models/cornellbox/tallbox.obj", white},
+        {"models/cornellbox/left.obj", red},
+        {"models/cornellbox/right.obj", green},
+        {"models/cornellbox/light.obj", light},
+    });
 
     Renderer r;
 